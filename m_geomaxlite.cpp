@@ -17,8 +17,10 @@
  */
 
 /// $ModAuthor: reverse <mike.chevronnet@gmail.com>
-/// $ModDesc: Adds city and country information to WHOIS using the MaxMind database and it's usermode +y.
-/// $ModConfig: <geolite dbpath="path/geodata/GeoLite2-City.mmdb">
+/// $ModDesc: Adds city and country information to WHOIS using the MaxMind database and it's usermode +y, live per-country/ASN counters through /GEOSTATS and a lookup benchmark through /GEOBENCH.
+/// $ModConfig: <geolite dbpath="path/geodata/GeoLite2-City.mmdb" asndbpath="path/geodata/GeoLite2-ASN.mmdb" countryonly="no" languages="en fr es" cachesize="4096" sync="yes" prefault="no" mlock="no" hugepages="no">
+/// $ModConfig: <geoblock country="XX,YY" asn="AS64496" action="reject|throttle" rate="10" burst="20" reason="Too many connections from your country.">
+/// $ModConfig: <oper geolanguage="fr">
 /// $ModDepends: core 4
 
 /// $LinkerFlags: -lmaxminddb
@@ -27,6 +29,16 @@
 #include "modules/whois.h"
 #include "extension.h"
 #include <maxminddb.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <fstream>
+#include <unordered_set>
+#include <random>
+#include <sys/mman.h>
+#include <unistd.h>
 
 class GeoLiteMode final : public SimpleUserMode
 {
@@ -37,33 +49,1367 @@ public:
     }
 };
 
+// Names of interned geo entities in every configured language, stored flat as
+// names[id * languages + language]. Language 0 is the server language and is
+// used whenever a name is missing in another language.
+class LocalizedNames
+{
+private:
+    std::vector<std::string> languages = { "en" };
+    std::vector<std::string> names;
+
+protected:
+    size_t count = 0;
+
+    size_t Add()
+    {
+        names.resize(names.size() + languages.size());
+        return count++;
+    }
+
+public:
+    const std::vector<std::string>& Languages() const
+    {
+        return languages;
+    }
+
+    // Returns the index of a language, or 0 if it is not configured.
+    size_t LanguageIndex(const std::string& language) const
+    {
+        auto it = std::find(languages.begin(), languages.end(), language);
+        return it == languages.end() ? 0 : it - languages.begin();
+    }
+
+    // Changes the configured languages, keeping the names of any language
+    // that is in both the old and the new list.
+    void SetLanguages(const std::vector<std::string>& newlanguages)
+    {
+        if (newlanguages == languages)
+            return;
+
+        std::vector<std::string> newnames(count * newlanguages.size());
+        for (size_t lang = 0; lang < newlanguages.size(); ++lang) {
+            auto it = std::find(languages.begin(), languages.end(), newlanguages[lang]);
+            if (it == languages.end())
+                continue;
+
+            size_t oldlang = it - languages.begin();
+            for (size_t id = 0; id < count; ++id)
+                newnames[id * newlanguages.size() + lang] = std::move(names[id * languages.size() + oldlang]);
+        }
+
+        languages = newlanguages;
+        names = std::move(newnames);
+    }
+
+    void SetName(size_t id, size_t lang, const std::string& name)
+    {
+        names[id * languages.size() + lang] = name;
+    }
+
+    // Reads the <field>.names.<language> strings of a database record.
+    void Resolve(size_t id, MMDB_entry_s entry, const char* field)
+    {
+        for (size_t lang = 0; lang < languages.size(); ++lang) {
+            const char* const path[] = { field, "names", languages[lang].c_str(), nullptr };
+            MMDB_entry_data_s data = {};
+            if (MMDB_aget_value(&entry, &data, path) == MMDB_SUCCESS && data.has_data && data.type == MMDB_DATA_TYPE_UTF8_STRING)
+                SetName(id, lang, std::string(data.utf8_string, data.data_size));
+        }
+    }
+
+    // Returns the name in a language, falling back to the server language.
+    // Returns an empty string if the name is not known in either.
+    const std::string& GetName(size_t id, size_t lang) const
+    {
+        const std::string& name = names[id * languages.size() + lang];
+        return name.empty() ? names[id * languages.size()] : name;
+    }
+};
+
+// Interned country codes and names. Id 0 is reserved for unknown addresses.
+// Ids are never reused so they stay valid when the database is reloaded.
+class CountryTable final : public LocalizedNames
+{
+private:
+    std::unordered_map<std::string, uint16_t> ids;
+    const std::string unknown = "Unknown";
+
+public:
+    std::vector<std::string> codes;
+
+    CountryTable()
+    {
+        codes.emplace_back();
+        Add();
+    }
+
+    uint16_t Intern(const std::string& code)
+    {
+        if (code.empty())
+            return 0;
+
+        auto it = ids.find(code);
+        if (it != ids.end())
+            return it->second;
+
+        if (codes.size() > UINT16_MAX)
+            return 0;
+
+        uint16_t id = static_cast<uint16_t>(Add());
+        codes.push_back(code);
+        ids.emplace(code, id);
+        return id;
+    }
+
+    const std::string& Name(uint16_t id, size_t lang = 0) const
+    {
+        const std::string& name = GetName(id, lang);
+        if (!name.empty())
+            return name;
+        return id ? codes[id] : unknown;
+    }
+};
+
+// City names interned by GeoNames id. A city's names are resolved in every
+// configured language the first time it is seen after a (re)load, so lookups
+// never walk the names map again. Id 0 is reserved for unknown cities.
+class CityTable final : public LocalizedNames
+{
+private:
+    std::unordered_map<uint32_t, uint32_t> ids;
+    std::vector<unsigned int> generations;
+    unsigned int generation = 1;
+    const std::string unknown = "Unknown";
+
+public:
+    CityTable()
+    {
+        Add();
+        generations.push_back(0);
+    }
+
+    // Marks every city as stale so its names are read again from the newly
+    // loaded database. Ids stay valid.
+    void Refresh()
+    {
+        generation++;
+    }
+
+    uint32_t Intern(uint32_t geoname_id, MMDB_entry_s entry)
+    {
+        if (!geoname_id)
+            return 0;
+
+        auto it = ids.find(geoname_id);
+        if (it == ids.end()) {
+            it = ids.emplace(geoname_id, static_cast<uint32_t>(Add())).first;
+            generations.push_back(0);
+        }
+
+        uint32_t id = it->second;
+        if (generations[id] != generation) {
+            Resolve(id, entry, "city");
+            generations[id] = generation;
+        }
+        return id;
+    }
+
+    const std::string& Name(uint32_t id, size_t lang = 0) const
+    {
+        const std::string& name = GetName(id, lang);
+        return name.empty() ? unknown : name;
+    }
+};
+
+// Flattened country-only view of the MaxMind search tree.
+//
+// The tree is walked once at load time and every network is collapsed into a
+// sorted list of (start address, country) intervals, merging neighbours that
+// share a country. Starts and countries live in separate arrays so the search
+// only touches the start array, and the search itself uses conditional moves
+// rather than branches.
+class CountryIndex final
+{
+private:
+    std::vector<uint32_t> v4_start;
+    std::vector<uint16_t> v4_country;
+    std::vector<uint64_t> v6_start_hi;
+    std::vector<uint64_t> v6_start_lo;
+    std::vector<uint16_t> v6_country;
+
+    struct Builder final
+    {
+        MMDB_s& mmdb;
+        CountryTable& table;
+        CountryIndex& index;
+        std::unordered_map<uint32_t, uint16_t> decoded;
+        std::unordered_set<uint16_t> resolved;
+        uint32_t skip_node;
+        bool v4;
+
+        Builder(MMDB_s& db, CountryTable& tbl, CountryIndex& idx)
+            : mmdb(db)
+            , table(tbl)
+            , index(idx)
+            , skip_node(UINT32_MAX)
+            , v4(false)
+        {
+        }
+
+        uint16_t Decode(MMDB_entry_s entry)
+        {
+            auto it = decoded.find(entry.offset);
+            if (it != decoded.end())
+                return it->second;
+
+            MMDB_entry_data_s code_data = {};
+            int status_code = MMDB_get_value(&entry, &code_data, "country", "iso_code", nullptr);
+            std::string code = (status_code == MMDB_SUCCESS && code_data.has_data) ? std::string(code_data.utf8_string, code_data.data_size) : "";
+
+            uint16_t id = table.Intern(code);
+            if (id && resolved.insert(id).second)
+                table.Resolve(id, entry, "country");
+
+            decoded.emplace(entry.offset, id);
+            return id;
+        }
+
+        void Emit(uint64_t hi, uint64_t lo, uint16_t country)
+        {
+            if (v4) {
+                if (!index.v4_country.empty() && index.v4_country.back() == country)
+                    return;
+                index.v4_start.push_back(static_cast<uint32_t>(lo));
+                index.v4_country.push_back(country);
+            } else {
+                if (!index.v6_country.empty() && index.v6_country.back() == country)
+                    return;
+                index.v6_start_hi.push_back(hi);
+                index.v6_start_lo.push_back(lo);
+                index.v6_country.push_back(country);
+            }
+        }
+
+        void Record(uint8_t type, uint64_t record, MMDB_entry_s entry, unsigned int depth, unsigned int width, uint64_t hi, uint64_t lo)
+        {
+            if (type == MMDB_RECORD_TYPE_SEARCH_NODE && record != skip_node)
+                Walk(static_cast<uint32_t>(record), depth, width, hi, lo);
+            else if (type == MMDB_RECORD_TYPE_DATA)
+                Emit(hi, lo, Decode(entry));
+            else
+                Emit(hi, lo, 0);
+        }
+
+        // Walks the subtree at node in address order. Bit positions are
+        // counted from the top of a 128-bit address so IPv4 keys end up in
+        // the low 32 bits of lo.
+        void Walk(uint32_t node, unsigned int depth, unsigned int width, uint64_t hi, uint64_t lo)
+        {
+            MMDB_search_node_s sn;
+            if (depth >= width || MMDB_read_node(&mmdb, node, &sn) != MMDB_SUCCESS) {
+                Emit(hi, lo, 0);
+                return;
+            }
+
+            unsigned int bit = (128 - width) + depth;
+            uint64_t rhi = hi;
+            uint64_t rlo = lo;
+            if (bit < 64)
+                rhi |= UINT64_C(1) << (63 - bit);
+            else
+                rlo |= UINT64_C(1) << (127 - bit);
+
+            Record(sn.left_record_type, sn.left_record, sn.left_record_entry, depth + 1, width, hi, lo);
+            Record(sn.right_record_type, sn.right_record, sn.right_record_entry, depth + 1, width, rhi, rlo);
+        }
+    };
+
+    // Finds the IPv4 subtree by following 96 zero bits from the root of an
+    // IPv6 database. Returns false if the database has no IPv4 data.
+    static bool FindIPv4Start(MMDB_s& mmdb, uint32_t& node)
+    {
+        node = 0;
+        if (mmdb.metadata.ip_version == 4)
+            return true;
+
+        for (unsigned int depth = 0; depth < 96; ++depth) {
+            MMDB_search_node_s sn;
+            if (MMDB_read_node(&mmdb, node, &sn) != MMDB_SUCCESS || sn.left_record_type != MMDB_RECORD_TYPE_SEARCH_NODE)
+                return false;
+            node = static_cast<uint32_t>(sn.left_record);
+        }
+        return true;
+    }
+
+    // Returns the position of the last start that is <= key. The first start
+    // is always zero so the result is always valid.
+    static size_t Search(const std::vector<uint32_t>& starts, uint32_t key)
+    {
+        const uint32_t* base = starts.data();
+        size_t len = starts.size();
+        while (len > 1) {
+            size_t half = len / 2;
+            base += (base[half] <= key) ? half : 0;
+            len -= half;
+        }
+        return base - starts.data();
+    }
+
+    static size_t Search(const std::vector<uint64_t>& hi, const std::vector<uint64_t>& lo, uint64_t khi, uint64_t klo)
+    {
+        size_t base = 0;
+        size_t len = hi.size();
+        while (len > 1) {
+            size_t half = len / 2;
+            size_t mid = base + half;
+            bool le = (hi[mid] < khi) | ((hi[mid] == khi) & (lo[mid] <= klo));
+            base += le ? half : 0;
+            len -= half;
+        }
+        return base;
+    }
+
+    static uint64_t Load64(const unsigned char* bytes)
+    {
+        uint64_t value = 0;
+        for (size_t i = 0; i < 8; ++i)
+            value = (value << 8) | bytes[i];
+        return value;
+    }
+
+public:
+    void Build(MMDB_s& mmdb, CountryTable& table)
+    {
+        v4_start.clear();
+        v4_country.clear();
+        v6_start_hi.clear();
+        v6_start_lo.clear();
+        v6_country.clear();
+
+        Builder builder(mmdb, table, *this);
+
+        uint32_t v4_node;
+        bool has_v4 = FindIPv4Start(mmdb, v4_node);
+        if (has_v4) {
+            builder.v4 = true;
+            builder.Walk(v4_node, 0, 32, 0, 0);
+        }
+
+        if (mmdb.metadata.ip_version == 6) {
+            // The IPv4 subtree is also reachable through the mapped and 6to4
+            // ranges. IPv4 clients use the IPv4 intervals so skip it here.
+            builder.v4 = false;
+            builder.skip_node = has_v4 ? v4_node : UINT32_MAX;
+            builder.Walk(0, 0, 128, 0, 0);
+        }
+
+        v4_start.shrink_to_fit();
+        v4_country.shrink_to_fit();
+        v6_start_hi.shrink_to_fit();
+        v6_start_lo.shrink_to_fit();
+        v6_country.shrink_to_fit();
+    }
+
+    uint16_t Find(uint32_t v4) const
+    {
+        if (v4_start.empty())
+            return 0;
+        return v4_country[Search(v4_start, v4)];
+    }
+
+    uint16_t Find(const irc::sockets::sockaddrs& sa) const
+    {
+        if (sa.family() == AF_INET)
+            return Find(ntohl(sa.in4.sin_addr.s_addr));
+
+        if (sa.family() == AF_INET6) {
+            // The ranges that alias the IPv4 subtree were skipped when
+            // building the IPv6 intervals, so follow the alias the way
+            // MMDB_lookup_sockaddr does: the 32 bits after ::/96 (where the
+            // subtree itself lives), ::ffff:0:0/96, 2002::/16 (6to4) and
+            // 2001::/32 (Teredo) are an IPv4 address.
+            const unsigned char* bytes = sa.in6.sin6_addr.s6_addr;
+            uint64_t hi = Load64(bytes);
+            uint64_t lo = Load64(bytes + 8);
+            if (hi == 0 && ((lo >> 32) == 0 || (lo >> 32) == 0xFFFF))
+                return Find(static_cast<uint32_t>(lo));
+            if ((hi >> 48) == 0x2002)
+                return Find(static_cast<uint32_t>(hi >> 16));
+            if ((hi >> 32) == 0x20010000)
+                return Find(static_cast<uint32_t>(hi));
+
+            if (v6_start_hi.empty())
+                return 0;
+            return v6_country[Search(v6_start_hi, v6_start_lo, hi, lo)];
+        }
+
+        return 0;
+    }
+
+    size_t size() const
+    {
+        return v4_start.size() + v6_start_hi.size();
+    }
+};
+
+// Live connection counters for one country. Connections are kept in ten
+// second slots covering the last five minutes so both rates can be read
+// without keeping any per-connection history.
+class GeoCounter final
+{
+private:
+    static constexpr time_t SLOT_SECONDS = 10;
+    static constexpr size_t SLOT_COUNT = 30;
+
+    std::array<uint32_t, SLOT_COUNT> slots = {};
+    time_t current = 0;
+
+    void Advance(time_t now)
+    {
+        time_t slot = now / SLOT_SECONDS;
+        if (slot <= current)
+            return;
+
+        time_t gap = std::min<time_t>(slot - current, SLOT_COUNT);
+        for (time_t i = 1; i <= gap; ++i)
+            slots[(current + i) % SLOT_COUNT] = 0;
+        current = slot;
+    }
+
+public:
+    uint32_t users = 0;
+    uint32_t refused = 0;
+
+    void Connect(time_t now)
+    {
+        Advance(now);
+        slots[current % SLOT_COUNT]++;
+    }
+
+    // Returns the number of connections during the last window seconds.
+    uint32_t Connections(time_t now, time_t window)
+    {
+        Advance(now);
+        size_t count = std::min<size_t>(window / SLOT_SECONDS, SLOT_COUNT);
+        uint32_t total = 0;
+        for (size_t i = 0; i < count; ++i)
+            total += slots[(current + SLOT_COUNT - i) % SLOT_COUNT];
+        return total;
+    }
+};
+
+// Admission policy for connections from one country. A policy either refuses
+// every connection or passes them through a token bucket that refills at rate
+// connections per minute up to burst.
+class GeoPolicy final
+{
+private:
+    double tokens;
+    time_t last = 0;
+
+public:
+    bool reject;
+    double rate;
+    double burst;
+    std::string reason;
+
+    GeoPolicy(bool Reject, double Rate, double Burst, const std::string& Reason)
+        : tokens(Burst)
+        , reject(Reject)
+        , rate(Rate)
+        , burst(Burst)
+        , reason(Reason)
+    {
+    }
+
+    bool Admit(time_t now)
+    {
+        if (reject)
+            return false;
+
+        if (last)
+            tokens = std::min(burst, tokens + (now - last) * rate / 60.0);
+        last = now;
+
+        if (tokens < 1.0)
+            return false;
+
+        tokens -= 1.0;
+        return true;
+    }
+};
+
+// ASN organisation names. Each name is stored once and looked up by ASN.
+class AsnTable final
+{
+private:
+    std::unordered_map<std::string, uint32_t> ids;
+    std::unordered_map<uint32_t, uint32_t> orgs;
+
+public:
+    std::vector<std::string> names;
+
+    AsnTable()
+    {
+        names.emplace_back("Unknown");
+    }
+
+    void Intern(uint32_t asn, const std::string& org)
+    {
+        if (!asn || org.empty() || orgs.count(asn))
+            return;
+
+        auto it = ids.find(org);
+        if (it == ids.end()) {
+            it = ids.emplace(org, static_cast<uint32_t>(names.size())).first;
+            names.push_back(org);
+        }
+        orgs.emplace(asn, it->second);
+    }
+
+    const std::string& Name(uint32_t asn) const
+    {
+        auto it = orgs.find(asn);
+        return it == orgs.end() ? names[0] : names[it->second];
+    }
+};
+
+// Result of looking an address up in the City and ASN databases. Names are
+// held as ids into the interned tables so any language can be shown.
+struct GeoRecord final
+{
+    uint16_t country = 0;
+    uint32_t city = 0;
+    uint32_t asn = 0;
+};
+
+// Direct-mapped cache of database lookups keyed by the /24 (IPv4) or /48
+// (IPv6) an address is in. Both the City and ASN lookups share an entry, and
+// an entry is only stored when every database matched a network at least that
+// wide, so a hit is always exact.
+class GeoCache final
+{
+private:
+    struct Entry final
+    {
+        uint64_t key = 0;
+        bool used = false;
+        GeoRecord record;
+    };
+
+    std::vector<Entry> entries;
+
+    size_t Slot(uint64_t key) const
+    {
+        return static_cast<size_t>((key * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & (entries.size() - 1);
+    }
+
+public:
+    static constexpr unsigned int V4_PREFIX = 24;
+    static constexpr unsigned int V6_PREFIX = 48;
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    static uint64_t MakeKey(const irc::sockets::sockaddrs& sa)
+    {
+        if (sa.family() == AF_INET)
+            return (UINT64_C(1) << 63) | (ntohl(sa.in4.sin_addr.s_addr) >> (32 - V4_PREFIX));
+
+        uint64_t key = 0;
+        for (size_t i = 0; i < V6_PREFIX / 8; ++i)
+            key = (key << 8) | sa.in6.sin6_addr.s6_addr[i];
+        return key;
+    }
+
+    void Reset(size_t size)
+    {
+        size_t slots = 1;
+        while (slots < size)
+            slots <<= 1;
+
+        entries.assign(slots, Entry());
+        hits = misses = 0;
+    }
+
+    const GeoRecord* Find(uint64_t key)
+    {
+        const Entry& entry = entries[Slot(key)];
+        if (entry.used && entry.key == key) {
+            hits++;
+            return &entry.record;
+        }
+
+        misses++;
+        return nullptr;
+    }
+
+    void Store(uint64_t key, const GeoRecord& record)
+    {
+        Entry& entry = entries[Slot(key)];
+        entry.key = key;
+        entry.used = true;
+        entry.record = record;
+    }
+
+    size_t size() const
+    {
+        return entries.size();
+    }
+};
+
+// Memory tuning for the mapping of an open MaxMind database. libmaxminddb maps
+// the file lazily so without this the first lookups after a (re)load take page
+// faults. Release must be called before the database is closed.
+class GeoMapping final
+{
+private:
+    const uint8_t* mapped_tree = nullptr; // Original search tree when it has been copied
+    void* copy_base = nullptr;            // Huge page backed copy of the search tree
+    size_t copy_size = 0;
+    const uint8_t* locked_file = nullptr; // Start of the file mapping if it is locked
+    size_t locked_size = 0;
+
+    static long Micros(std::chrono::steady_clock::time_point start)
+    {
+        return static_cast<long>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+
+public:
+    void Apply(MMDB_s& db, const std::string& name, bool prefault, bool lock, bool hugepages)
+    {
+        const size_t file_size = static_cast<size_t>(db.file_size);
+        if (prefault) {
+            auto start = std::chrono::steady_clock::now();
+            madvise(const_cast<uint8_t*>(db.file_content), file_size, MADV_WILLNEED);
+
+            const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            const volatile uint8_t* bytes = db.file_content;
+            uint8_t sink = 0;
+            for (size_t offset = 0; offset < file_size; offset += page)
+                sink ^= bytes[offset];
+            (void)sink;
+
+            ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Prefaulted {} KiB of {} in {}us", file_size / 1024, name, Micros(start)));
+        }
+
+        if (lock) {
+            auto start = std::chrono::steady_clock::now();
+            if (mlock(db.file_content, file_size) == 0) {
+                locked_file = db.file_content;
+                locked_size = file_size;
+                ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Locked {} KiB of {} in memory in {}us", file_size / 1024, name, Micros(start)));
+            } else {
+                ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Unable to lock {} in memory: {}", name, strerror(errno)));
+            }
+        }
+
+#ifdef MADV_HUGEPAGE
+        if (hugepages) {
+            // The search tree sits at the start of the file and libmaxminddb
+            // only reads it through file_content; the data section has its own
+            // pointer. Pointing file_content at an aligned copy lets the kernel
+            // back the tree with transparent huge pages.
+            auto start = std::chrono::steady_clock::now();
+            const size_t huge_page = 2 * 1024 * 1024;
+            const size_t tree_size = static_cast<size_t>(db.metadata.node_count) * db.full_record_byte_size;
+            const size_t alloc_size = ((tree_size + huge_page - 1) & ~(huge_page - 1)) + huge_page;
+
+            void* base = mmap(nullptr, alloc_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (base == MAP_FAILED) {
+                ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Unable to allocate huge pages for {}: {}", name, strerror(errno)));
+                return;
+            }
+
+            uint8_t* aligned = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(base) + huge_page - 1) & ~(huge_page - 1));
+            madvise(aligned, alloc_size - (aligned - static_cast<uint8_t*>(base)), MADV_HUGEPAGE);
+            memcpy(aligned, db.file_content, tree_size);
+            mprotect(base, alloc_size, PROT_READ);
+            if (lock)
+                mlock(aligned, tree_size);
+
+            copy_base = base;
+            copy_size = alloc_size;
+            mapped_tree = db.file_content;
+            db.file_content = aligned;
+
+            ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Copied {} KiB search tree of {} to huge pages in {}us", tree_size / 1024, name, Micros(start)));
+        }
+#else
+        if (hugepages)
+            ServerInstance->Logs.Normal(MODNAME, "Huge page backed search trees are not supported on this platform.");
+#endif
+    }
+
+    void Release(MMDB_s& db)
+    {
+        if (copy_base) {
+            db.file_content = mapped_tree;
+            munmap(copy_base, copy_size);
+            copy_base = nullptr;
+            mapped_tree = nullptr;
+        }
+
+        if (locked_file) {
+            munlock(locked_file, locked_size);
+            locked_file = nullptr;
+        }
+    }
+};
+
+class CommandGeoStats final : public Command
+{
+private:
+    CountryTable& countries;
+    std::vector<GeoCounter>& counters;
+    AsnTable& asns;
+    std::unordered_map<uint32_t, GeoCounter>& asn_counters;
+
+    static constexpr unsigned long DEFAULT_ENTRIES = 10;
+    static constexpr unsigned long MAX_ENTRIES = 100;
+
+    struct Row final
+    {
+        std::string label;
+        uint32_t users;
+        uint32_t last1m;
+        uint32_t last5m;
+        uint32_t refused;
+    };
+
+    static bool AddRow(std::vector<Row>& rows, std::string label, GeoCounter& counter, time_t now)
+    {
+        Row row = { std::move(label), counter.users, counter.Connections(now, 60), counter.Connections(now, 300), counter.refused };
+        if (!row.users && !row.last5m && !row.refused)
+            return false;
+
+        rows.push_back(std::move(row));
+        return true;
+    }
+
+public:
+    CommandGeoStats(Module* Creator, CountryTable& Countries, std::vector<GeoCounter>& Counters, AsnTable& Asns, std::unordered_map<uint32_t, GeoCounter>& AsnCounters)
+        : Command(Creator, "GEOSTATS", 0, 2)
+        , countries(Countries)
+        , counters(Counters)
+        , asns(Asns)
+        , asn_counters(AsnCounters)
+    {
+        access_needed = CmdAccess::OPERATOR;
+        syntax = { "[country|asn] [<count>]" };
+    }
+
+    CmdResult Handle(User* user, const Params& parameters) override
+    {
+        size_t param = 0;
+        bool byasn = false;
+        if (param < parameters.size() && (parameters[param] == "asn" || parameters[param] == "country"))
+            byasn = (parameters[param++] == "asn");
+
+        unsigned long limit = param < parameters.size() ? ConvToNum<unsigned long>(parameters[param]) : DEFAULT_ENTRIES;
+        if (!limit)
+            limit = DEFAULT_ENTRIES;
+        limit = std::min(limit, MAX_ENTRIES);
+
+        // Only the counter tables are read here, never the user list.
+        time_t now = ServerInstance->Time();
+        std::vector<Row> rows;
+        if (byasn) {
+            for (auto& [asn, counter] : asn_counters)
+                AddRow(rows, asn ? INSP_FORMAT("AS{} {}", asn, asns.Name(asn)) : "?? Unknown", counter, now);
+        } else {
+            for (size_t id = 0; id < counters.size(); ++id)
+                AddRow(rows, INSP_FORMAT("{} {}", id ? countries.codes[id] : "??", countries.Name(static_cast<uint16_t>(id))), counters[id], now);
+        }
+
+        size_t shown = std::min<size_t>(limit, rows.size());
+        std::partial_sort(rows.begin(), rows.begin() + shown, rows.end(), [](const Row& a, const Row& b) {
+            if (a.users != b.users)
+                return a.users > b.users;
+            return a.last5m > b.last5m;
+        });
+
+        user->WriteNotice(INSP_FORMAT("*** GEOSTATS: Top {} of {} {} by local users (connections in the last 1m/5m):", shown, rows.size(), byasn ? "ASNs" : "countries"));
+        for (size_t i = 0; i < shown; ++i) {
+            const Row& row = rows[i];
+            user->WriteNotice(INSP_FORMAT("*** GEOSTATS: {}: {} users, {}/1m, {}/5m, {} refused", row.label, row.users, row.last1m, row.last5m, row.refused));
+        }
+        user->WriteNotice("*** GEOSTATS: End of list.");
+        return CmdResult::SUCCESS;
+    }
+};
+
 class ModuleWhoisGeoLite final : public Module, public Whois::EventListener
 {
 private:
     MMDB_s mmdb;                 // MaxMind database object
+    bool mmdb_open = false;      // Whether mmdb currently holds an open database
+    MMDB_s asndb;                // MaxMind ASN database object
+    bool asndb_open = false;     // Whether asndb currently holds an open database
+    GeoMapping mmdb_mapping;     // Memory tuning applied to mmdb
+    GeoMapping asndb_mapping;    // Memory tuning applied to asndb
     std::string dbpath;          // Path to the GeoLite2 database
+    std::string asndbpath;       // Path to the GeoLite2 ASN database, empty if disabled
+    bool countryonly;            // Whether to skip the full lookup and use the country index
+    bool syncinfo;               // Whether to send geo info to other servers rather than computing it locally
+    CountryTable countries;      // Interned country codes and names
+    CountryIndex country_index;  // Flattened country-only index of the database
+    AsnTable asns;               // Interned ASN organisation names
+    GeoCache cache;              // Prefix cache shared by the City and ASN lookups
+    std::vector<GeoCounter> country_counters; // Live counters indexed by country id
+    std::unordered_map<uint32_t, GeoCounter> asn_counters; // Live counters by ASN
+    std::unordered_map<uint16_t, GeoPolicy> country_policies; // <geoblock> policies by country id
+    std::unordered_map<uint32_t, GeoPolicy> asn_policies; // <geoblock> policies by ASN
     StringExtItem country_item;  // Extension item for storing city and country info
+    CityTable cities;            // Interned city names
+    SimpleExtItem<GeoRecord> location_item; // Country, city and ASN ids of the user (local only)
+    IntExtItem country_id_item;  // Country id + 1 the user is counted under (local only)
+    IntExtItem asn_item;         // ASN the user is counted under (local only)
     GeoLiteMode geolite_mode;    // User mode +y for controlling geolocation visibility
+    CommandGeoStats geostats_cmd;
+
+    // Replays a synthetic or recorded address distribution through each
+    // lookup path and reports the cost per lookup. This runs on the main
+    // loop so it is restricted to opers and capped in size, and it works on
+    // its own cache and name tables so the live ones are left alone.
+    class CommandGeoBench final : public Command
+    {
+    private:
+        ModuleWhoisGeoLite* parent;
+
+        static constexpr unsigned long DEFAULT_LOOKUPS = 100000;
+        static constexpr unsigned long MAX_LOOKUPS = 100000;
+        static constexpr size_t MAX_DISTINCT = 65536;
+        static constexpr double ZIPF_EXPONENT = 1.1;
+
+        // An address as 16 bytes, with IPv4 mapped into ::ffff:0:0/96. The
+        // full sockaddrs is several times larger because of sockaddr_un.
+        typedef std::array<uint8_t, 16> BenchKey;
+
+        static BenchKey ToKey(const irc::sockets::sockaddrs& sa)
+        {
+            BenchKey key = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+            if (sa.family() == AF_INET6)
+                memcpy(key.data(), sa.in6.sin6_addr.s6_addr, 16);
+            else
+                memcpy(key.data() + 12, &sa.in4.sin_addr, 4);
+            return key;
+        }
+
+        static void ToAddress(const BenchKey& key, irc::sockets::sockaddrs& sa)
+        {
+            static const uint8_t mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+            if (!memcmp(key.data(), mapped, sizeof(mapped))) {
+                sa.in4.sin_family = AF_INET;
+                memcpy(&sa.in4.sin_addr, key.data() + 12, 4);
+            } else {
+                sa.in6.sin6_family = AF_INET6;
+                memcpy(sa.in6.sin6_addr.s6_addr, key.data(), 16);
+            }
+        }
+
+        static BenchKey RandomAddress(std::mt19937_64& rng, bool v6)
+        {
+            BenchKey key = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+            if (v6) {
+                // Stay inside 2000::/3 where the allocated space is.
+                uint64_t hi = (rng() & ~(UINT64_C(7) << 61)) | (UINT64_C(1) << 61);
+                uint64_t lo = rng();
+                for (size_t i = 0; i < 8; ++i) {
+                    key[i] = static_cast<uint8_t>(hi >> (56 - 8 * i));
+                    key[i + 8] = static_cast<uint8_t>(lo >> (56 - 8 * i));
+                }
+            } else {
+                uint32_t v4 = static_cast<uint32_t>(rng());
+                for (size_t i = 0; i < 4; ++i)
+                    key[12 + i] = static_cast<uint8_t>(v4 >> (24 - 8 * i));
+            }
+            return key;
+        }
+
+        // Builds a Zipf-skewed sequence over a pool of distinct addresses so
+        // a few addresses repeat heavily, as they do during clone floods.
+        static std::vector<BenchKey> Synthesize(unsigned long lookups, unsigned int v6percent)
+        {
+            std::mt19937_64 rng(lookups);
+            std::uniform_int_distribution<unsigned int> percent(0, 99);
+
+            size_t distinct = std::min<size_t>(std::max<size_t>(lookups / 10, 1), MAX_DISTINCT);
+            std::vector<BenchKey> pool;
+            std::vector<double> weights;
+            pool.reserve(distinct);
+            weights.reserve(distinct);
+            for (size_t i = 0; i < distinct; ++i) {
+                pool.push_back(RandomAddress(rng, percent(rng) < v6percent));
+                weights.push_back(1.0 / std::pow(static_cast<double>(i + 1), ZIPF_EXPONENT));
+            }
+
+            std::discrete_distribution<size_t> zipf(weights.begin(), weights.end());
+            std::vector<BenchKey> addresses;
+            addresses.reserve(lookups);
+            for (unsigned long i = 0; i < lookups; ++i)
+                addresses.push_back(pool[zipf(rng)]);
+            return addresses;
+        }
+
+        // Loads one address per line, repeating the file to fill lookups.
+        static bool Load(const std::string& path, unsigned long lookups, std::vector<BenchKey>& addresses)
+        {
+            std::ifstream stream(path);
+            if (!stream.is_open())
+                return false;
+
+            std::vector<BenchKey> recorded;
+            std::string line;
+            while (std::getline(stream, line) && recorded.size() < lookups) {
+                irc::sockets::sockaddrs sa;
+                if (sa.from_ip(line))
+                    recorded.push_back(ToKey(sa));
+            }
+
+            if (recorded.empty())
+                return false;
+
+            addresses.reserve(lookups);
+            for (unsigned long i = 0; i < lookups; ++i)
+                addresses.push_back(recorded[i % recorded.size()]);
+            return true;
+        }
+
+        static size_t ResidentKiB()
+        {
+            std::ifstream statm("/proc/self/statm");
+            size_t total = 0;
+            size_t resident = 0;
+            if (!(statm >> total >> resident))
+                return 0;
+            return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE)) / 1024;
+        }
+
+        // Every path pays the same cost of expanding the key.
+        template<typename Func>
+        static double Measure(const std::vector<BenchKey>& addresses, Func&& func)
+        {
+            irc::sockets::sockaddrs sa;
+            auto start = std::chrono::steady_clock::now();
+            for (const auto& key : addresses) {
+                ToAddress(key, sa);
+                func(sa);
+            }
+            auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+            return static_cast<double>(elapsed.count()) / addresses.size();
+        }
+
+    public:
+        CommandGeoBench(ModuleWhoisGeoLite* Parent)
+            : Command(Parent, "GEOBENCH", 0, 3)
+            , parent(Parent)
+        {
+            access_needed = CmdAccess::OPERATOR;
+            syntax = { "[<lookups>] [<ipv6-percent>] [<file>]" };
+        }
+
+        CmdResult Handle(User* user, const Params& parameters) override
+        {
+            if (!user->HasPrivPermission("servers/auspex")) {
+                user->WriteNotice("*** GEOBENCH: You do not have permission to use this command.");
+                return CmdResult::FAILURE;
+            }
+
+            unsigned long lookups = parameters.size() > 0 ? ConvToNum<unsigned long>(parameters[0]) : DEFAULT_LOOKUPS;
+            lookups = std::min(lookups ? lookups : DEFAULT_LOOKUPS, MAX_LOOKUPS);
+            unsigned int v6percent = parameters.size() > 1 ? std::min(ConvToNum<unsigned int>(parameters[1]), 100U) : 20;
+
+            std::vector<BenchKey> addresses;
+            if (parameters.size() > 2) {
+                // Recordings are read from the data directory only.
+                const std::string& file = parameters[2];
+                if (file.empty() || file.find('/') != std::string::npos || file.find("..") != std::string::npos) {
+                    user->WriteNotice("*** GEOBENCH: The file must be a plain name in the data directory.");
+                    return CmdResult::FAILURE;
+                }
+
+                std::string path = ServerInstance->Config->Paths.PrependData(file);
+                if (!Load(path, lookups, addresses)) {
+                    user->WriteNotice("*** GEOBENCH: Unable to read any addresses from " + path);
+                    return CmdResult::FAILURE;
+                }
+            } else {
+                addresses = Synthesize(lookups, v6percent);
+            }
+
+            size_t rss_before = ResidentKiB();
+            uint64_t sink = 0;
+
+            double raw = Measure(addresses, [&](const irc::sockets::sockaddrs& sa) {
+                int gai_error = 0;
+                MMDB_lookup_result_s result = MMDB_lookup_sockaddr(&parent->mmdb, &sa.sa, &gai_error);
+                if (gai_error == 0 && result.found_entry) {
+                    MMDB_entry_data_s city_data = {};
+                    MMDB_entry_data_s country_data = {};
+                    MMDB_get_value(&result.entry, &city_data, "city", "names", "en", nullptr);
+                    MMDB_get_value(&result.entry, &country_data, "country", "names", "en", nullptr);
+                    sink += city_data.data_size + country_data.data_size;
+                }
+            });
+
+            double index = Measure(addresses, [&](const irc::sockets::sockaddrs& sa) {
+                sink += parent->LookupCountry(sa);
+            });
+
+            GeoCache benchcache;
+            CityTable benchcities;
+            AsnTable benchasns;
+            benchcache.Reset(parent->cache.size());
+            benchcities.SetLanguages(parent->cities.Languages());
+            double cached = Measure(addresses, [&](const irc::sockets::sockaddrs& sa) {
+                sink += parent->Lookup(sa, benchcache, benchcities, benchasns).asn;
+            });
+
+            size_t rss_after = ResidentKiB();
+            uint64_t probes = benchcache.hits + benchcache.misses;
+            uint64_t live_probes = parent->cache.hits + parent->cache.misses;
+
+            user->WriteNotice(INSP_FORMAT("*** GEOBENCH: {} lookups ({}), checksum {}", addresses.size(),
+                parameters.size() > 2 ? "recorded" : INSP_FORMAT("synthetic, {}% IPv6", v6percent), sink));
+            user->WriteNotice(INSP_FORMAT("*** GEOBENCH: MMDB lookup + get_value: {:.1f} ns/lookup", raw));
+            user->WriteNotice(INSP_FORMAT("*** GEOBENCH: Flattened country index: {:.1f} ns/lookup", index));
+            user->WriteNotice(INSP_FORMAT("*** GEOBENCH: Full lookup via prefix cache: {:.1f} ns/lookup, {:.1f}% hit rate over {} probes",
+                cached, probes ? 100.0 * benchcache.hits / probes : 0.0, probes));
+            user->WriteNotice(INSP_FORMAT("*** GEOBENCH: Live prefix cache: {:.1f}% hit rate over {} probes, {} slots",
+                live_probes ? 100.0 * parent->cache.hits / live_probes : 0.0, live_probes, parent->cache.size()));
+            user->WriteNotice(INSP_FORMAT("*** GEOBENCH: RSS {} KiB before, {} KiB after", rss_before, rss_after));
+            return CmdResult::SUCCESS;
+        }
+    };
+
+    CommandGeoBench geobench_cmd;
+
+    GeoCounter& CountryCounter(uint16_t id)
+    {
+        if (id >= country_counters.size())
+            country_counters.resize(countries.codes.size());
+        return country_counters[id];
+    }
+
+    void CountUser(LocalUser* user, const GeoRecord& record)
+    {
+        time_t now = ServerInstance->Time();
+        GeoCounter& counter = CountryCounter(record.country);
+        counter.users++;
+        counter.Connect(now);
+        country_id_item.Set(user, record.country + 1);
+
+        if (asndb_open) {
+            GeoCounter& asncounter = asn_counters[record.asn];
+            asncounter.users++;
+            asncounter.Connect(now);
+            asn_item.Set(user, static_cast<intptr_t>(record.asn) + 1);
+        }
+    }
+
+    void UncountUser(User* user)
+    {
+        intptr_t stored = country_id_item.Get(user);
+        if (stored) {
+            GeoCounter& counter = CountryCounter(static_cast<uint16_t>(stored - 1));
+            if (counter.users)
+                counter.users--;
+            country_id_item.Unset(user);
+        }
+
+        stored = asn_item.Get(user);
+        if (stored) {
+            GeoCounter& counter = asn_counters[static_cast<uint32_t>(stored - 1)];
+            if (counter.users)
+                counter.users--;
+            asn_item.Unset(user);
+        }
+    }
+
+    static MMDB_s OpenDatabase(Module* mod, const std::string& path)
+    {
+        MMDB_s db;
+        int status_open = MMDB_open(path.c_str(), MMDB_MODE_MMAP, &db);
+        if (status_open != MMDB_SUCCESS) {
+            std::string error_msg = "GeoLite2: Failed to open " + path + ": " + std::string(MMDB_strerror(status_open));
+            throw ModuleException(mod, error_msg.c_str());
+        }
+        return db;
+    }
+
+    // Returns the prefix length of the network a lookup matched, in bits of
+    // the address family that was looked up.
+    static unsigned int NetworkPrefix(const MMDB_s& db, const MMDB_lookup_result_s& result, bool v4)
+    {
+        if (v4 && db.metadata.ip_version == 6)
+            return result.netmask > 96 ? result.netmask - 96 : 0;
+        return result.netmask;
+    }
+
+    static std::string GetString(MMDB_entry_s& entry, const char* const* path)
+    {
+        MMDB_entry_data_s data = {};
+        if (MMDB_aget_value(&entry, &data, path) != MMDB_SUCCESS || !data.has_data || data.type != MMDB_DATA_TYPE_UTF8_STRING)
+            return "";
+        return std::string(data.utf8_string, data.data_size);
+    }
 
 public:
     ModuleWhoisGeoLite()
         : Module(VF_OPTCOMMON, "Adds city and country information to WHOIS using the MaxMind database.")
         , Whois::EventListener(this)
         , country_item(this, "geo-lite-country", ExtensionType::USER, true) // Sync across servers
+        , location_item(this, "geo-lite-location", ExtensionType::USER)
+        , country_id_item(this, "geo-lite-country-id", ExtensionType::USER)
+        , asn_item(this, "geo-lite-asn", ExtensionType::USER)
         , geolite_mode(this)
+        , geostats_cmd(this, countries, country_counters, asns, asn_counters)
+        , geobench_cmd(this)
     {
     }
 
     void ReadConfig(ConfigStatus& status) override
     {
+        // Parse the admission policies before touching the database so a bad
+        // <geoblock> tag leaves the current setup in place.
+        std::vector<std::pair<std::string, GeoPolicy>> newpolicies;
+        std::vector<std::pair<uint32_t, GeoPolicy>> newasnpolicies;
+        for (const auto& [_, blocktag] : ServerInstance->Config->ConfTags("geoblock")) {
+            std::string action = blocktag->getString("action", "throttle");
+            if (action != "reject" && action != "throttle")
+                throw ModuleException(this, "<geoblock:action> must be either reject or throttle, not " + action);
+
+            double rate = blocktag->getFloat("rate", 10, 0, 1000000);
+            double burst = blocktag->getFloat("burst", rate, 1, 1000000);
+            if (action == "throttle" && rate <= 0)
+                throw ModuleException(this, "<geoblock:rate> must be greater than zero for throttle policies.");
+
+            std::string reason = blocktag->getString("reason", "Too many connections from your network, please try again later.");
+            GeoPolicy policy(action == "reject", rate, burst, reason);
+
+            irc::commasepstream codestream(blocktag->getString("country"));
+            std::string code;
+            while (codestream.GetToken(code)) {
+                std::transform(code.begin(), code.end(), code.begin(), ::toupper);
+                newpolicies.emplace_back(code, policy);
+            }
+
+            irc::commasepstream asnstream(blocktag->getString("asn"));
+            std::string asn;
+            while (asnstream.GetToken(asn)) {
+                if (asn.length() > 2 && (asn[0] == 'A' || asn[0] == 'a') && (asn[1] == 'S' || asn[1] == 's'))
+                    asn.erase(0, 2);
+
+                uint32_t asnum = ConvToNum<uint32_t>(asn);
+                if (!asnum)
+                    throw ModuleException(this, "<geoblock:asn> contains an invalid ASN: " + asn);
+                newasnpolicies.emplace_back(asnum, policy);
+            }
+        }
+
         auto& tag = ServerInstance->Config->ConfValue("geolite");
         dbpath = ServerInstance->Config->Paths.PrependConfig(tag->getString("dbpath", "data/GeoLite2-City.mmdb"));
+        asndbpath = tag->getString("asndbpath");
+        if (!asndbpath.empty())
+            asndbpath = ServerInstance->Config->Paths.PrependConfig(asndbpath);
+        countryonly = tag->getBool("countryonly", false);
+        syncinfo = tag->getBool("sync", true);
 
-        int status_open = MMDB_open(dbpath.c_str(), MMDB_MODE_MMAP, &mmdb);
-        if (status_open != MMDB_SUCCESS) {
-            std::string error_msg = "GeoLite2: Failed to open GeoLite2 database: " + std::string(MMDB_strerror(status_open));
-            throw ModuleException(this, error_msg.c_str());
+        std::vector<std::string> languages;
+        irc::spacesepstream langstream(tag->getString("languages", "en"));
+        std::string language;
+        while (langstream.GetToken(language)) {
+            if (std::find(languages.begin(), languages.end(), language) == languages.end())
+                languages.push_back(language);
         }
+        if (languages.empty())
+            languages.push_back("en");
+
+        if (!newasnpolicies.empty() && asndbpath.empty())
+            throw ModuleException(this, "<geoblock:asn> requires <geolite:asndbpath> to be set.");
+
+        MMDB_s newdb = OpenDatabase(this, dbpath);
+        MMDB_s newasndb = {};
+        if (!asndbpath.empty()) {
+            try {
+                newasndb = OpenDatabase(this, asndbpath);
+            } catch (const ModuleException&) {
+                MMDB_close(&newdb);
+                throw;
+            }
+        }
+
+        bool prefault = tag->getBool("prefault", false);
+        bool lock = tag->getBool("mlock", false);
+        bool hugepages = tag->getBool("hugepages", false);
+
+        GeoMapping newmapping;
+        newmapping.Apply(newdb, dbpath, prefault, lock, hugepages);
+        GeoMapping newasnmapping;
+        if (!asndbpath.empty())
+            newasnmapping.Apply(newasndb, asndbpath, prefault, lock, hugepages);
+
+        if (mmdb_open) {
+            mmdb_mapping.Release(mmdb);
+            MMDB_close(&mmdb);
+        }
+        mmdb = newdb;
+        mmdb_mapping = newmapping;
+        mmdb_open = true;
+
+        if (asndb_open) {
+            asndb_mapping.Release(asndb);
+            MMDB_close(&asndb);
+        }
+        asndb_open = !asndbpath.empty();
+        if (asndb_open) {
+            asndb = newasndb;
+            asndb_mapping = newasnmapping;
+        }
+
+        cache.Reset(tag->getNum<size_t>("cachesize", 4096, 1, 1048576));
+        countries.SetLanguages(languages);
+        cities.SetLanguages(languages);
+        cities.Refresh();
+
+        auto start = std::chrono::steady_clock::now();
+        country_index.Build(mmdb, countries);
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Built country index with {} intervals for {} countries in {}ms",
+            country_index.size(), countries.codes.size() - 1, elapsed.count()));
+
+        country_policies.clear();
+        for (const auto& [code, policy] : newpolicies)
+            country_policies.insert_or_assign(countries.Intern(code), policy);
+
+        asn_policies.clear();
+        for (const auto& [asnum, policy] : newasnpolicies)
+            asn_policies.insert_or_assign(asnum, policy);
+    }
+
+    // Applies any <geoblock> policies for the record. Returns false if the
+    // connection has been refused.
+    bool AdmitUser(LocalUser* user, const GeoRecord& record)
+    {
+        time_t now = ServerInstance->Time();
+        const GeoPolicy* refused = nullptr;
+
+        auto cit = country_policies.find(record.country);
+        if (cit != country_policies.end() && !cit->second.Admit(now)) {
+            CountryCounter(record.country).refused++;
+            refused = &cit->second;
+        } else {
+            auto ait = asn_policies.find(record.asn);
+            if (ait != asn_policies.end() && !ait->second.Admit(now)) {
+                asn_counters[record.asn].refused++;
+                refused = &ait->second;
+            }
+        }
+
+        if (!refused)
+            return true;
+
+        ServerInstance->Logs.Debug(MODNAME, INSP_FORMAT("Refusing connection from {} ({}, AS{})", user->client_sa.addr(), countries.codes[record.country], record.asn));
+        ServerInstance->Users.QuitUser(user, refused->reason);
+        return false;
+    }
+
+    // Country-only lookup through the flattened index. Returns 0 if unknown.
+    uint16_t LookupCountry(const irc::sockets::sockaddrs& sa) const
+    {
+        return country_index.Find(sa);
+    }
+
+    // Looks an address up in every configured database in one pass. The
+    // country always comes from the flattened index; the city and ASN come
+    // from the prefix cache or, on a miss, the MaxMind databases.
+    GeoRecord Lookup(const irc::sockets::sockaddrs& sa)
+    {
+        return Lookup(sa, cache, cities, asns);
+    }
+
+    GeoRecord Lookup(const irc::sockets::sockaddrs& sa, GeoCache& with, CityTable& citytable, AsnTable& asntable)
+    {
+        GeoRecord record;
+        record.country = LookupCountry(sa);
+        if (countryonly && !asndb_open)
+            return record;
+
+        uint64_t key = GeoCache::MakeKey(sa);
+        if (const GeoRecord* cached = with.Find(key)) {
+            record.city = cached->city;
+            record.asn = cached->asn;
+            return record;
+        }
+
+        bool v4 = sa.family() == AF_INET;
+        unsigned int prefix = v4 ? GeoCache::V4_PREFIX : GeoCache::V6_PREFIX;
+        bool cacheable = true;
+
+        if (!countryonly) {
+            int gai_error = 0;
+            MMDB_lookup_result_s result = MMDB_lookup_sockaddr(&mmdb, &sa.sa, &gai_error);
+            cacheable &= (gai_error == 0 && NetworkPrefix(mmdb, result, v4) <= prefix);
+            if (gai_error == 0 && result.found_entry) {
+                MMDB_entry_data_s geoname_data = {};
+                if (MMDB_get_value(&result.entry, &geoname_data, "city", "geoname_id", nullptr) == MMDB_SUCCESS && geoname_data.has_data)
+                    record.city = citytable.Intern(geoname_data.uint32, result.entry);
+            }
+        }
+
+        if (asndb_open) {
+            int gai_error = 0;
+            MMDB_lookup_result_s result = MMDB_lookup_sockaddr(&asndb, &sa.sa, &gai_error);
+            cacheable &= (gai_error == 0 && NetworkPrefix(asndb, result, v4) <= prefix);
+            if (gai_error == 0 && result.found_entry) {
+                MMDB_entry_data_s asn_data = {};
+                if (MMDB_get_value(&result.entry, &asn_data, "autonomous_system_number", nullptr) == MMDB_SUCCESS && asn_data.has_data) {
+                    static const char* const org_path[] = { "autonomous_system_organization", nullptr };
+                    record.asn = asn_data.uint32;
+                    asntable.Intern(record.asn, GetString(result.entry, org_path));
+                }
+            }
+        }
+
+        if (cacheable)
+            with.Store(key, record);
+        return record;
+    }
+
+    // Builds the WHOIS text for a record in a language. Returns an empty
+    // string if nothing is known about the address.
+    std::string Describe(const GeoRecord& record, size_t lang = 0) const
+    {
+        if (countryonly)
+            return record.country ? "Country: " + countries.Name(record.country, lang) : "";
+
+        if (!record.country && !record.city)
+            return "";
+
+        return "City: " + cities.Name(record.city, lang) + ", Country: " + countries.Name(record.country, lang);
+    }
+
+    // Returns the language WHOIS output is shown to a user in: the oper's
+    // <oper:geolanguage> if it is configured, otherwise the server language.
+    size_t WhoisLanguage(User* source) const
+    {
+        if (!source->IsOper())
+            return 0;
+        return countries.LanguageIndex(source->oper->GetConfig()->getString("geolanguage"));
+    }
+
+    // Returns the location of a user. When info is not synced, users from
+    // other servers are looked up from their IP on first use and cached.
+    const GeoRecord* GetLocation(User* user)
+    {
+        const GeoRecord* location = location_item.Get(user);
+        if (location || syncinfo || !user->client_sa.is_ip())
+            return location;
+
+        location_item.Set(user, Lookup(user->client_sa));
+        return location_item.Get(user);
     }
 
     void OnWhois(Whois::Context& whois) override
@@ -74,50 +1420,74 @@ public:
         if (!target->IsModeSet(geolite_mode))
             return;
 
-        const std::string* info = country_item.Get(target);
-        if (info && !info->empty()) {
-            whois.SendLine(RPL_WHOISSPECIAL, "is connecting from " + *info);
+        std::string info;
+        const GeoRecord* location = GetLocation(target);
+        if (location) {
+            info = Describe(*location, WhoisLanguage(whois.GetSource()));
+        } else {
+            const std::string* synced = country_item.Get(target);
+            if (synced)
+                info = *synced;
+        }
+
+        if (!info.empty()) {
+            whois.SendLine(RPL_WHOISSPECIAL, "is connecting from " + info);
         } else {
             whois.SendLine(RPL_WHOISSPECIAL, "City: Unknown, Country: Unknown");
         }
+
+        if (location && location->asn && whois.GetSource()->IsOper())
+            whois.SendLine(RPL_WHOISSPECIAL, INSP_FORMAT("is connecting through AS{} ({})", location->asn, asns.Name(location->asn)));
     }
 
     void OnChangeRemoteAddress(LocalUser* user) override
     {
+        UncountUser(user);
+
         if (!user->client_sa.is_ip()) {
+            location_item.Unset(user);
             country_item.Unset(user);
             return;
         }
 
-        int gai_error = 0;
-        const struct sockaddr* addr = &user->client_sa.sa;
-        MMDB_lookup_result_s result = MMDB_lookup_sockaddr(&mmdb, addr, &gai_error);
+        GeoRecord record = Lookup(user->client_sa);
+        CountUser(user, record);
 
-        if (gai_error != 0 || !result.found_entry) {
-            country_item.Unset(user);
+        // Refused clients quit here, before any registration work happens.
+        if (!AdmitUser(user, record))
             return;
-        }
 
-        MMDB_entry_data_s city_data = {};
-        MMDB_entry_data_s country_data = {};
-        int status_city = MMDB_get_value(&result.entry, &city_data, "city", "names", "en", nullptr);
-        int status_country = MMDB_get_value(&result.entry, &country_data, "country", "names", "en", nullptr);
-
-        std::string city = (status_city == MMDB_SUCCESS && city_data.has_data) ? std::string(city_data.utf8_string, city_data.data_size) : "Unknown";
-        std::string country = (status_country == MMDB_SUCCESS && country_data.has_data) ? std::string(country_data.utf8_string, country_data.data_size) : "Unknown";
+        location_item.Set(user, record);
+        if (!syncinfo)
+            return;
 
-        country_item.Set(user, "City: " + city + ", Country: " + country);
+        // Other servers get the text in the server language.
+        std::string info = Describe(record);
+        if (info.empty())
+            country_item.Unset(user);
+        else
+            country_item.Set(user, info);
     }
 
     void OnUserQuit(User* user, const std::string& message, const std::string& opermessage) override
     {
+        if (IS_LOCAL(user))
+            UncountUser(user);
+
         if (user->IsModeSet(geolite_mode))
             country_item.Unset(user);
     }
 
     ~ModuleWhoisGeoLite() override
     {
-        MMDB_close(&mmdb);
+        if (mmdb_open) {
+            mmdb_mapping.Release(mmdb);
+            MMDB_close(&mmdb);
+        }
+        if (asndb_open) {
+            asndb_mapping.Release(asndb);
+            MMDB_close(&asndb);
+        }
     }
 };
 
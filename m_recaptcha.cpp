@@ -13,47 +13,2311 @@
 /// $LinkerFlags: find_linker_flags("libpq")
 
 /// $ModAuthor: reverse mike.chevronnet@gmail.com
-/// $ModConfig: <captchaconfig conninfo="dbname=example user=postgres password=secret hostaddr=127.0.0.1 port=5432" ports="6667,6697" url="http://meme.com/verify/">
+/// $ModConfig: <captchaconfig conninfo="dbname=example user=postgres password=secret hostaddr=127.0.0.1 port=5432" ports="6667,6697" url="http://meme.com/verify/" timeout="10s" cachesize="65536" cacheduration="10m" negativeduration="30s" maxattempts="5" connections="2" pinginterval="1m" tokenkey="shared secret" tokenpersist="no" hold="no" holdtimeout="1m" cleanupinterval="1h">
 /// $ModDepends: core 4
 
 #include "inspircd.h"
 #include "extension.h"
+#include "modules/hash.h"
 #include <libpq-fe.h>
 #include <unordered_map>
 #include <unordered_set>
-#include <chrono>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <sstream>
 
+// Called when a query finishes. The result is null if the query could not be
+// run at all, and is cleared after the callback returns.
+typedef std::function<void(PGresult* result)> CaptchaCallback;
+
+// The type OIDs of int8 and inet, from pg_type.h which is not installed with
+// libpq.
+static constexpr Oid INT8_OID = 20;
+static constexpr Oid INET_OID = 869;
+
+// A statement prepared on every new connection. Its parameters are sent in
+// binary as the given types, and binary results are requested when format
+// is 1. Statements which use the expires_at column have a legacy version
+// for tables which have not been given it, with the same parameters and
+// result columns; it is null for the others.
+struct CaptchaStatement
+{
+    const char* name;
+    const char* sql;
+    const char* legacy;
+    int params;
+    Oid types[2];
+    int format;
+};
+
+static const CaptchaStatement CAPTCHA_STATEMENTS[] = {
+    { "captcha_check", "SELECT 1 FROM ircaccess_alloweduser WHERE ip_address >>= $1 AND (expires_at IS NULL OR expires_at > now()) LIMIT 1",
+        "SELECT 1 FROM ircaccess_alloweduser WHERE ip_address >>= $1 LIMIT 1", 1, { INET_OID }, 0 },
+    // Without expires_at an entry which should expire is not added at all.
+    { "captcha_add", "INSERT INTO ircaccess_alloweduser (ip_address, expires_at) VALUES ($1, to_timestamp(NULLIF($2, 0)))",
+        "INSERT INTO ircaccess_alloweduser (ip_address) SELECT $1 WHERE $2 = 0", 2, { INET_OID, INT8_OID }, 0 },
+    { "captcha_search", "SELECT ip_address, expires_at FROM ircaccess_alloweduser WHERE ip_address >>= $1 OR ip_address << $1",
+        "SELECT ip_address, NULL::timestamptz FROM ircaccess_alloweduser WHERE ip_address >>= $1 OR ip_address << $1", 1, { INET_OID }, 0 },
+    { "captcha_listen", "LISTEN ircaccess_alloweduser", nullptr, 0, { }, 0 },
+    { "captcha_load", "SELECT ip_address, EXTRACT(EPOCH FROM expires_at)::int8 FROM ircaccess_alloweduser WHERE expires_at IS NULL OR expires_at > now()",
+        "SELECT ip_address, NULL::int8 FROM ircaccess_alloweduser", 0, { }, 1 },
+    { "captcha_ping", "SELECT 1", nullptr, 0, { }, 0 },
+    { "captcha_cleanup", "DELETE FROM ircaccess_alloweduser WHERE ctid IN (SELECT ctid FROM ircaccess_alloweduser WHERE expires_at <= now() LIMIT $1)",
+        "DELETE FROM ircaccess_alloweduser WHERE false AND $1 > 0", 1, { INT8_OID }, 0 },
+};
+
+// Asked on every new connection, before anything else is prepared, to find
+// out which version of the statements the table needs.
+static const CaptchaStatement CAPTCHA_SCHEMA = { "captcha_schema",
+    "SELECT 1 FROM information_schema.columns WHERE table_schema = ANY (current_schemas(false)) AND table_name = 'ircaccess_alloweduser' AND column_name = 'expires_at'",
+    nullptr, 0, { }, 0 };
+
+// A statement to prepare (when prepare is set) or to execute.
+struct CaptchaQuery
+{
+    const CaptchaStatement* statement;
+    bool prepare;
+    std::vector<std::string> params;
+    CaptchaCallback callback;
+};
+
+// An address prefix as two 64-bit words in host order, with IPv4 prefixes
+// mapped into ::ffff:0:0/96.
+struct CaptchaPrefix
+{
+    uint64_t hi = 0;
+    uint64_t lo = 0;
+    unsigned int length = 0;
+
+    static uint64_t Load64(const unsigned char* bytes)
+    {
+        uint64_t value = 0;
+        for (size_t i = 0; i < 8; ++i)
+            value = (value << 8) | bytes[i];
+        return value;
+    }
+
+    static void Store64(uint64_t value, unsigned char* bytes)
+    {
+        for (size_t i = 8; i-- > 0; value >>= 8)
+            bytes[i] = value & 0xFF;
+    }
+
+    CaptchaPrefix() = default;
+
+    // Builds a prefix from 4 or 16 address bytes in network order.
+    CaptchaPrefix(const unsigned char* bytes, size_t size, unsigned int bits)
+    {
+        unsigned char mapped[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+        if (size == 4)
+        {
+            memcpy(mapped + 12, bytes, 4);
+            bits += 96;
+        }
+        else
+        {
+            memcpy(mapped, bytes, 16);
+        }
+
+        hi = Load64(mapped);
+        lo = Load64(mapped + 8);
+        length = std::min(bits, 128U);
+        Mask();
+    }
+
+    CaptchaPrefix(const irc::sockets::sockaddrs& sa)
+        : CaptchaPrefix(sa.family() == AF_INET6 ? reinterpret_cast<const unsigned char*>(&sa.in6.sin6_addr) : reinterpret_cast<const unsigned char*>(&sa.in4.sin_addr),
+            sa.family() == AF_INET6 ? 16 : 4, sa.family() == AF_INET6 ? 128 : 32)
+    {
+    }
+
+    // Parses an address or an address/length prefix.
+    static bool Parse(const std::string& str, CaptchaPrefix& prefix)
+    {
+        std::string::size_type slash = str.find('/');
+        irc::sockets::sockaddrs sa;
+        if (!sa.from_ip(str.substr(0, slash)))
+            return false;
+
+        prefix = CaptchaPrefix(sa);
+        if (slash == std::string::npos)
+            return true;
+
+        unsigned int maxbits = sa.family() == AF_INET6 ? 128 : 32;
+        std::string length = str.substr(slash + 1);
+        if (length.empty() || length.size() > 3 || length.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+
+        unsigned int bits = ConvToNum<unsigned int>(length);
+        if (bits > maxbits)
+            return false;
+
+        prefix.length = bits + (128 - maxbits);
+        prefix.Mask();
+        return true;
+    }
+
+    bool IsIPv4() const
+    {
+        return length >= 96 && hi == 0 && (lo >> 32) == 0xFFFF;
+    }
+
+    void Mask()
+    {
+        hi &= length >= 64 ? ~0ULL : (length ? ~0ULL << (64 - length) : 0);
+        lo &= length >= 128 ? ~0ULL : (length > 64 ? ~0ULL << (128 - length) : 0);
+    }
+
+    unsigned int Bit(unsigned int index) const
+    {
+        return index < 64 ? (hi >> (63 - index)) & 1 : (lo >> (127 - index)) & 1;
+    }
+
+    // The number of leading bits shared with another prefix, up to limit.
+    unsigned int Common(const CaptchaPrefix& other, unsigned int limit) const
+    {
+        uint64_t diff = hi ^ other.hi;
+        unsigned int common = diff ? __builtin_clzll(diff) : 64 + (lo != other.lo ? __builtin_clzll(lo ^ other.lo) : 64);
+        return std::min(common, limit);
+    }
+
+    bool operator==(const CaptchaPrefix& other) const
+    {
+        return hi == other.hi && lo == other.lo && length == other.length;
+    }
+
+    // Encodes the prefix in the binary wire format of inet: family, netmask
+    // bits, cidr flag, address length and the address in network order.
+    std::string ToInet() const
+    {
+        unsigned char bytes[16];
+        Store64(hi, bytes);
+        Store64(lo, bytes + 8);
+
+        std::string value;
+        if (IsIPv4())
+        {
+            value.push_back(2); // PGSQL_AF_INET
+            value.push_back(static_cast<char>(length - 96));
+            value.push_back(0);
+            value.push_back(4);
+            value.append(reinterpret_cast<const char*>(bytes + 12), 4);
+        }
+        else
+        {
+            value.push_back(3); // PGSQL_AF_INET6
+            value.push_back(static_cast<char>(length));
+            value.push_back(0);
+            value.push_back(16);
+            value.append(reinterpret_cast<const char*>(bytes), 16);
+        }
+        return value;
+    }
+
+    // Decodes a binary inet or cidr value.
+    static bool FromInet(const char* value, int size, CaptchaPrefix& prefix)
+    {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(value);
+        if (size < 4 || bytes[3] != size - 4 || (bytes[3] != 4 && bytes[3] != 16) || bytes[1] > bytes[3] * 8)
+            return false;
+
+        prefix = CaptchaPrefix(bytes + 4, bytes[3], bytes[1]);
+        return true;
+    }
+};
+
+// Encodes an address as a binary inet value.
+static std::string EncodeInet(const irc::sockets::sockaddrs& sa)
+{
+    return CaptchaPrefix(sa).ToInet();
+}
+
+// Encodes a number as a binary int8 value.
+static std::string EncodeInt8(int64_t value)
+{
+    std::string bytes(8, '\0');
+    CaptchaPrefix::Store64(static_cast<uint64_t>(value), reinterpret_cast<unsigned char*>(&bytes[0]));
+    return bytes;
+}
+
+struct CaptchaPrefixHash
+{
+    size_t operator()(const CaptchaPrefix& prefix) const
+    {
+        return std::hash<uint64_t>()((prefix.hi * 0x9E3779B97F4A7C15ULL) ^ prefix.lo ^ prefix.length);
+    }
+};
+
+// A hierarchical timer wheel of allowlist entry expiries. Its four levels of
+// 64 slots are one second, 64 seconds, about an hour and about three days
+// wide, so advancing it by a second costs O(1) plus the entries that fire or
+// move down a level. Entries more than about six months away wait in an
+// overflow list.
+class CaptchaExpiryWheel
+{
+public:
+    struct Expiry
+    {
+        CaptchaPrefix prefix;
+        time_t expires;
+    };
+
+private:
+    static constexpr unsigned int LEVELS = 4;
+    static constexpr unsigned int SLOT_BITS = 6;
+    static constexpr time_t SLOTS = 1 << SLOT_BITS;
+
+    std::vector<Expiry> slots[LEVELS][SLOTS];
+    std::vector<Expiry> overflow;
+    time_t now = 0;
+
+    // Files an entry in the lowest level whose range covers it. Entries due
+    // before earliest are filed to fire at earliest.
+    void Place(const Expiry& expiry, time_t earliest)
+    {
+        time_t target = std::max(expiry.expires, earliest);
+        for (unsigned int level = 0; level < LEVELS; ++level)
+        {
+            unsigned int shift = SLOT_BITS * level;
+            if ((target >> shift) - (now >> shift) < SLOTS)
+            {
+                slots[level][(target >> shift) & (SLOTS - 1)].push_back(expiry);
+                return;
+            }
+        }
+        overflow.push_back(expiry);
+    }
+
+    template<typename Fire>
+    void Step(Fire& fire)
+    {
+        now++;
+
+        // Each time a level wraps, the next slot of the level above is spread
+        // over the levels below.
+        for (unsigned int level = 1; level <= LEVELS; ++level)
+        {
+            unsigned int shift = SLOT_BITS * level;
+            if (now & ((static_cast<time_t>(1) << shift) - 1))
+                break;
+
+            std::vector<Expiry> moving;
+            moving.swap(level == LEVELS ? overflow : slots[level][(now >> shift) & (SLOTS - 1)]);
+            for (const auto& expiry : moving)
+                Place(expiry, now);
+        }
+
+        std::vector<Expiry> firing;
+        firing.swap(slots[0][now & (SLOTS - 1)]);
+        for (const auto& expiry : firing)
+            fire(expiry);
+    }
+
+public:
+    void Reset(time_t start)
+    {
+        for (auto& level : slots)
+        {
+            for (auto& slot : level)
+                slot.clear();
+        }
+        overflow.clear();
+        now = start;
+    }
+
+    void Add(const CaptchaPrefix& prefix, time_t expires)
+    {
+        Place({ prefix, expires }, now + 1);
+    }
+
+    // Moves the wheel on to the given time, calling fire for each entry that
+    // expired on the way. After a long jump, such as a clock change, the
+    // wheel is rebuilt instead of stepped through.
+    template<typename Fire>
+    void Advance(time_t to, Fire fire)
+    {
+        if (to - now <= SLOTS * SLOTS)
+        {
+            while (now < to)
+                Step(fire);
+            return;
+        }
+
+        std::vector<Expiry> all;
+        all.swap(overflow);
+        for (auto& level : slots)
+        {
+            for (auto& slot : level)
+            {
+                all.insert(all.end(), slot.begin(), slot.end());
+                slot.clear();
+            }
+        }
+
+        now = to;
+        for (const auto& expiry : all)
+        {
+            if (expiry.expires <= now)
+                fire(expiry);
+            else
+                Place(expiry, now + 1);
+        }
+    }
+};
+
+// An in-memory copy of ircaccess_alloweduser, whose entries may be single
+// addresses or prefixes, as a path-compressed binary radix tree. IPv4
+// prefixes are mapped into IPv6 so one walk answers a check for either.
+//
+// It is loaded in full on every connection and kept current with
+// notifications on the ircaccess_alloweduser channel, whose payload is
+// "add <prefix> [<expiry>]" or "del <prefix>", the expiry being a UNIX time.
+// The web verify app can send these itself or through a trigger such as:
+//
+//   CREATE FUNCTION ircaccess_alloweduser_notify() RETURNS trigger AS $$
+//   BEGIN
+//       IF TG_OP = 'DELETE' THEN
+//           PERFORM pg_notify('ircaccess_alloweduser', 'del ' || OLD.ip_address::text);
+//       ELSE
+//           PERFORM pg_notify('ircaccess_alloweduser', 'add ' || NEW.ip_address::text
+//               || COALESCE(' ' || EXTRACT(EPOCH FROM NEW.expires_at)::int8, ''));
+//       END IF;
+//       RETURN NULL;
+//   END;
+//   $$ LANGUAGE plpgsql;
+//
+//   CREATE TRIGGER ircaccess_alloweduser_notify
+//       AFTER INSERT OR DELETE ON ircaccess_alloweduser
+//       FOR EACH ROW EXECUTE FUNCTION ircaccess_alloweduser_notify();
+//
+// Prefixes are stored in the existing inet column (e.g. '2001:db8:1:2::/64').
+// Entries which expire need a column for when, which is null for entries
+// that never do:
+//
+//   ALTER TABLE ircaccess_alloweduser ADD COLUMN expires_at timestamptz;
+//
+// Expired entries are dropped from the copy as they expire and deleted from
+// the table every cleanupinterval. Checks use >>=, which a GiST index makes
+// fast on large tables:
+//
+//   CREATE INDEX ircaccess_alloweduser_ip_gist
+//       ON ircaccess_alloweduser USING gist (ip_address inet_ops);
+class CaptchaAllowlist
+{
+private:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    struct Node
+    {
+        CaptchaPrefix prefix;
+        bool terminal;        // Whether the prefix itself is allowed
+        uint32_t child[2];
+    };
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> free_nodes;
+    uint32_t root = NONE;
+    size_t entries = 0;
+    bool loaded = false;
+    std::unordered_map<CaptchaPrefix, time_t, CaptchaPrefixHash> expiries; // Entries which expire
+    CaptchaExpiryWheel wheel;
+
+    uint32_t NewNode(const CaptchaPrefix& prefix, bool terminal)
+    {
+        Node node = { prefix, terminal, { NONE, NONE } };
+        if (free_nodes.empty())
+        {
+            nodes.push_back(node);
+            return static_cast<uint32_t>(nodes.size() - 1);
+        }
+
+        uint32_t id = free_nodes.back();
+        free_nodes.pop_back();
+        nodes[id] = node;
+        return id;
+    }
+
+    // The link pointing at a node: the root or a child slot of its parent.
+    uint32_t& Link(uint32_t parent, unsigned int side)
+    {
+        return parent == NONE ? root : nodes[parent].child[side];
+    }
+
+public:
+    // Whether the table has been loaded at least once. Until then checks go
+    // to the database.
+    bool IsLoaded() const
+    {
+        return loaded;
+    }
+
+    size_t Size() const
+    {
+        return entries;
+    }
+
+    // Whether any allowed prefix contains the address.
+    bool Contains(const irc::sockets::sockaddrs& sa) const
+    {
+        CaptchaPrefix address(sa);
+        uint32_t id = root;
+        while (id != NONE)
+        {
+            const Node& node = nodes[id];
+            if (address.Common(node.prefix, node.prefix.length) < node.prefix.length)
+                return false;
+            if (node.terminal)
+                return true;
+            id = node.child[address.Bit(node.prefix.length)];
+        }
+        return false;
+    }
+
+    // Adds a prefix to the tree. Returns false if it was already there.
+    bool Insert(const CaptchaPrefix& prefix)
+    {
+        uint32_t parent = NONE;
+        unsigned int side = 0;
+        while (true)
+        {
+            uint32_t id = Link(parent, side);
+            if (id == NONE)
+            {
+                uint32_t leaf = NewNode(prefix, true);
+                Link(parent, side) = leaf;
+                entries++;
+                return true;
+            }
+
+            const CaptchaPrefix nodeprefix = nodes[id].prefix;
+            unsigned int common = prefix.Common(nodeprefix, std::min(prefix.length, nodeprefix.length));
+            if (common == nodeprefix.length)
+            {
+                if (prefix.length == nodeprefix.length)
+                {
+                    if (nodes[id].terminal)
+                        return false;
+
+                    entries++;
+                    nodes[id].terminal = true;
+                    return true;
+                }
+
+                parent = id;
+                side = prefix.Bit(nodeprefix.length);
+                continue;
+            }
+
+            // The new prefix diverges from this node or contains it, so a node
+            // is inserted above it.
+            uint32_t split;
+            if (common == prefix.length)
+            {
+                split = NewNode(prefix, true);
+            }
+            else
+            {
+                CaptchaPrefix shared = prefix;
+                shared.length = common;
+                shared.Mask();
+                split = NewNode(shared, false);
+                uint32_t leaf = NewNode(prefix, true);
+                nodes[split].child[prefix.Bit(common)] = leaf;
+            }
+
+            nodes[split].child[nodeprefix.Bit(common)] = id;
+            Link(parent, side) = split;
+            entries++;
+            return true;
+        }
+    }
+
+    void Erase(const CaptchaPrefix& prefix)
+    {
+        // The path down to the prefix, as (parent, side) links.
+        std::vector<std::pair<uint32_t, unsigned int>> path;
+        uint32_t parent = NONE;
+        unsigned int side = 0;
+        while (true)
+        {
+            uint32_t id = Link(parent, side);
+            if (id == NONE || prefix.length < nodes[id].prefix.length || prefix.Common(nodes[id].prefix, nodes[id].prefix.length) < nodes[id].prefix.length)
+                return;
+
+            path.emplace_back(parent, side);
+            if (nodes[id].prefix.length == prefix.length)
+                break;
+
+            parent = id;
+            side = prefix.Bit(nodes[id].prefix.length);
+        }
+
+        uint32_t id = Link(path.back().first, path.back().second);
+        if (!nodes[id].terminal)
+            return;
+
+        nodes[id].terminal = false;
+        entries--;
+
+        // Splice out nodes which no longer allow anything and have at most
+        // one child, walking back up the path.
+        while (!path.empty())
+        {
+            uint32_t& link = Link(path.back().first, path.back().second);
+            Node& node = nodes[link];
+            if (node.terminal || (node.child[0] != NONE && node.child[1] != NONE))
+                break;
+
+            uint32_t removed = link;
+            link = node.child[0] != NONE ? node.child[0] : node.child[1];
+            free_nodes.push_back(removed);
+            path.pop_back();
+        }
+    }
+
+    // Allows a prefix until expires, or forever if it is 0. A prefix listed
+    // more than once lasts as long as its longest-lived entry.
+    void Add(const CaptchaPrefix& prefix, time_t expires = 0)
+    {
+        bool added = Insert(prefix);
+        auto it = expiries.find(prefix);
+        if (!expires)
+        {
+            if (it != expiries.end())
+                expiries.erase(it);
+            return;
+        }
+
+        if (!added && it == expiries.end())
+            return; // Already allowed forever.
+
+        if (it == expiries.end() || it->second < expires)
+        {
+            expiries[prefix] = expires;
+            wheel.Add(prefix, expires);
+        }
+    }
+
+    void Remove(const CaptchaPrefix& prefix)
+    {
+        Erase(prefix);
+        expiries.erase(prefix);
+    }
+
+    // Removes the entries which have expired by now, adding them to expired.
+    // Wheel entries left behind by a prefix that was re-added with a later
+    // expiry or removed are ignored.
+    void Expire(time_t now, std::vector<CaptchaPrefix>& expired)
+    {
+        wheel.Advance(now, [this, &expired](const CaptchaExpiryWheel::Expiry& expiry)
+        {
+            auto it = expiries.find(expiry.prefix);
+            if (it == expiries.end() || it->second != expiry.expires)
+                return;
+
+            expiries.erase(it);
+            Erase(expiry.prefix);
+            expired.push_back(expiry.prefix);
+        });
+    }
+
+    // Replaces the contents with the rows of a captcha_load result: the
+    // address and its expiry as a UNIX timestamp, or null if it never expires.
+    void Load(PGresult* res, time_t now)
+    {
+        nodes.clear();
+        free_nodes.clear();
+        root = NONE;
+        entries = 0;
+        expiries.clear();
+        wheel.Reset(now);
+
+        nodes.reserve(PQntuples(res) * 2);
+        for (int row = 0; row < PQntuples(res); ++row)
+        {
+            CaptchaPrefix prefix;
+            if (!CaptchaPrefix::FromInet(PQgetvalue(res, row, 0), PQgetlength(res, row, 0), prefix))
+                continue;
+
+            time_t expires = 0;
+            if (!PQgetisnull(res, row, 1) && PQgetlength(res, row, 1) == 8)
+                expires = static_cast<time_t>(CaptchaPrefix::Load64(reinterpret_cast<const unsigned char*>(PQgetvalue(res, row, 1))));
+            Add(prefix, expires);
+        }
+        loaded = true;
+    }
+
+    // Applies an "add <prefix> [<expiry>]" or "del <prefix>" notification payload and
+    // returns the prefix it was about.
+    bool Apply(const std::string& payload, CaptchaPrefix& prefix)
+    {
+        irc::spacesepstream stream(payload);
+        std::string action;
+        std::string address;
+        if (!stream.GetToken(action) || !stream.GetToken(address) || !CaptchaPrefix::Parse(address, prefix))
+            return false;
+
+        if (action == "add")
+        {
+            // An optional third token is the UNIX time the entry expires.
+            std::string expiry;
+            time_t expires = stream.GetToken(expiry) ? ConvToNum<time_t>(expiry) : 0;
+            if (!expires || expires > ServerInstance->Time())
+                Add(prefix, expires);
+        }
+        else if (action == "del")
+            Remove(prefix);
+        else
+            return false;
+        return true;
+    }
+};
+
+// A non-blocking PostgreSQL connection driven by the socket engine. Queries
+// are queued and, when libpq supports pipeline mode, sent back-to-back with
+// their results matched in order, otherwise one at a time. The main loop
+// never waits on the database, including while connecting.
+class CaptchaDatabase : public EventHandler
+{
+private:
+    enum class Status
+    {
+        DEAD,
+        CONNECTING,
+        READY
+    };
+
+    static constexpr time_t RECONNECT_DELAY = 5;
+    static constexpr time_t MAX_RECONNECT_DELAY = 300;
+    static constexpr time_t QUERY_TIMEOUT = 30;
+    static constexpr size_t MAX_PIPELINE = 256;
+
+    std::string conninfo;
+    PGconn* conn = nullptr;
+    Status status = Status::DEAD;
+    std::deque<CaptchaQuery> queue;
+    std::deque<CaptchaQuery> inflight; // Sent queries waiting for their results
+    std::deque<time_t> sent_times;     // When each query in inflight was sent
+    bool pipeline = false;         // Whether the connection is in pipeline mode
+    bool probing = false;          // Whether the schema is still being checked
+    bool legacy = false;           // Whether the table has no expires_at column
+    PGresult* result = nullptr;    // First result of the oldest query in flight
+    time_t next_attempt = 0;
+    time_t retry_delay = RECONNECT_DELAY;
+    time_t last_active = 0;        // When the server last sent anything
+    time_t connect_started = 0;    // When the current connection attempt began
+    std::function<void(CaptchaDatabase&)> on_connect;
+    std::function<void(const std::string&)> on_notify;
+    std::function<void(CaptchaDatabase&)> on_fail;
+
+    void PollConnect()
+    {
+        switch (PQconnectPoll(conn))
+        {
+            case PGRES_POLLING_WRITING:
+                SocketEngine::ChangeEventMask(this, FD_WANT_POLL_WRITE | FD_WANT_NO_READ);
+                break;
+
+            case PGRES_POLLING_READING:
+                SocketEngine::ChangeEventMask(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+                break;
+
+            case PGRES_POLLING_FAILED:
+                Fail(PQerrorMessage(conn));
+                break;
+
+            case PGRES_POLLING_OK:
+                status = Status::READY;
+                retry_delay = RECONNECT_DELAY;
+                last_active = ServerInstance->Time();
+                SocketEngine::ChangeEventMask(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+                ServerInstance->Logs.Normal(MODNAME, "Connected to PostgreSQL database.");
+
+#ifdef LIBPQ_HAS_PIPELINING
+                // Checks arriving together, such as after a netsplit, are sent
+                // without waiting for each other's round trip.
+                pipeline = PQenterPipelineMode(conn);
+#endif
+
+                // Nothing else is sent until the schema is known, as a
+                // statement using a missing column would fail to prepare and
+                // take the rest of the pipeline with it.
+                probing = true;
+                queue.push_front({ &CAPTCHA_SCHEMA, false, {}, [this](PGresult* res) { OnSchema(res); } });
+                queue.push_front({ &CAPTCHA_SCHEMA, true, {}, [](PGresult* res)
+                {
+                    if (!res || PQresultStatus(res) != PGRES_COMMAND_OK)
+                        ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Failed to prepare {}: {}", CAPTCHA_SCHEMA.name, res ? PQresultErrorMessage(res) : "no result"));
+                } });
+                on_connect(*this);
+                SendNext();
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    // Picks the statements for the table and prepares them ahead of
+    // everything queued while connecting.
+    void OnSchema(PGresult* res)
+    {
+        probing = false;
+        if (!res || PQresultStatus(res) != PGRES_TUPLES_OK)
+        {
+            ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Failed to check the allowlist table: {}", res ? PQresultErrorMessage(res) : "no result"));
+            legacy = false;
+        }
+        else
+        {
+            legacy = PQntuples(res) == 0;
+        }
+
+        if (legacy)
+        {
+            const char* warning = "*** reCAPTCHA: ircaccess_alloweduser has no expires_at column, so allowlist entries will not expire. Add it with: ALTER TABLE ircaccess_alloweduser ADD COLUMN expires_at timestamptz;";
+            ServerInstance->Logs.Normal(MODNAME, warning);
+            ServerInstance->SNO.WriteToSnoMask('a', warning);
+        }
+
+        for (size_t i = sizeof(CAPTCHA_STATEMENTS) / sizeof(CAPTCHA_STATEMENTS[0]); i-- > 0; )
+        {
+            const CaptchaStatement* statement = &CAPTCHA_STATEMENTS[i];
+            queue.push_front({ statement, true, {}, [statement](PGresult* res)
+            {
+                if (!res || PQresultStatus(res) != PGRES_COMMAND_OK)
+                {
+                    std::string message = INSP_FORMAT("*** reCAPTCHA: Failed to prepare {}: {}", statement->name, res ? PQresultErrorMessage(res) : "no result");
+                    ServerInstance->Logs.Normal(MODNAME, message);
+                    ServerInstance->SNO.WriteToSnoMask('a', message);
+                }
+            } });
+        }
+    }
+
+    void SendNext()
+    {
+        size_t limit = pipeline ? MAX_PIPELINE : 1;
+        bool batched = false;
+        while (status == Status::READY && inflight.size() < limit && !queue.empty())
+        {
+            CaptchaQuery& query = queue.front();
+            const CaptchaStatement* statement = query.statement;
+            if (probing && statement != &CAPTCHA_SCHEMA)
+                break;
+
+            int ok;
+            if (query.prepare)
+            {
+                const char* sql = legacy && statement->legacy ? statement->legacy : statement->sql;
+                ok = PQsendPrepare(conn, statement->name, sql, statement->params, statement->types);
+            }
+            else
+            {
+                std::vector<const char*> values;
+                std::vector<int> lengths;
+                std::vector<int> formats(query.params.size(), 1);
+                for (const auto& param : query.params)
+                {
+                    values.push_back(param.data());
+                    lengths.push_back(static_cast<int>(param.size()));
+                }
+                ok = PQsendQueryPrepared(conn, statement->name, static_cast<int>(values.size()), values.data(), lengths.data(), formats.data(), statement->format);
+            }
+
+            if (!ok)
+            {
+                ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Failed to send query: {}", PQerrorMessage(conn)));
+                CaptchaCallback callback = std::move(query.callback);
+                queue.pop_front();
+                callback(nullptr);
+                continue;
+            }
+
+            inflight.push_back(std::move(query));
+            sent_times.push_back(ServerInstance->Time());
+            queue.pop_front();
+            batched = true;
+        }
+
+        if (!batched)
+            return;
+
+#ifdef LIBPQ_HAS_PIPELINING
+        // A sync point after each batch keeps an error in one query from
+        // aborting the queries of later batches.
+        if (pipeline && !PQpipelineSync(conn))
+        {
+            Fail(PQerrorMessage(conn));
+            return;
+        }
+#endif
+        Flush();
+    }
+
+    void Flush()
+    {
+        int flushed = PQflush(conn);
+        if (flushed < 0)
+            Fail(PQerrorMessage(conn));
+        else if (flushed > 0)
+            SocketEngine::ChangeEventMask(this, FD_WANT_POLL_READ | FD_WANT_POLL_WRITE);
+        else
+            SocketEngine::ChangeEventMask(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+    }
+
+    void ReadResults()
+    {
+        if (!PQconsumeInput(conn))
+        {
+            Fail(PQerrorMessage(conn));
+            return;
+        }
+
+        last_active = ServerInstance->Time();
+        while (PGnotify* notify = PQnotifies(conn))
+        {
+            std::string payload = notify->extra;
+            PQfreemem(notify);
+            on_notify(payload);
+        }
+
+        while (status == Status::READY && !inflight.empty() && !PQisBusy(conn))
+        {
+            PGresult* res = PQgetResult(conn);
+            if (res)
+            {
+#ifdef LIBPQ_HAS_PIPELINING
+                if (PQresultStatus(res) == PGRES_PIPELINE_SYNC)
+                {
+                    PQclear(res);
+                    continue;
+                }
+#endif
+                if (result)
+                    PQclear(res);
+                else
+                    result = res;
+                continue;
+            }
+
+            // A null result ends the results of the oldest query. In pipeline
+            // mode it is also returned when nothing more has arrived yet.
+            if (!result)
+                break;
+
+            CaptchaQuery query = std::move(inflight.front());
+            inflight.pop_front();
+            sent_times.pop_front();
+
+            PGresult* finished = result;
+            result = nullptr;
+            query.callback(finished);
+            PQclear(finished);
+        }
+
+        SendNext();
+    }
+
+public:
+    CaptchaDatabase(std::function<void(CaptchaDatabase&)> connected, std::function<void(const std::string&)> notified, std::function<void(CaptchaDatabase&)> failed)
+        : on_connect(std::move(connected)), on_notify(std::move(notified)), on_fail(std::move(failed))
+    {
+    }
+
+    // Drops the connection and schedules a reconnect, backing off
+    // exponentially while the database stays unreachable.
+    void Fail(const std::string& reason)
+    {
+        ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("PostgreSQL connection failed, retrying in {} seconds: {}", retry_delay, reason));
+        Close();
+        next_attempt = ServerInstance->Time() + retry_delay;
+        retry_delay = std::min(retry_delay * 2, MAX_RECONNECT_DELAY);
+
+        // Queued queries are answered straight away so nothing waits on a
+        // connection that is not there.
+        std::deque<CaptchaQuery> failed;
+        failed.swap(inflight);
+        std::move(queue.begin(), queue.end(), std::back_inserter(failed));
+        queue.clear();
+        for (auto& query : failed)
+            query.callback(nullptr);
+
+        on_fail(*this);
+    }
+
+    void SetConnInfo(const std::string& info)
+    {
+        if (conninfo == info)
+            return;
+
+        conninfo = info;
+        if (status != Status::DEAD)
+            Fail("connection info changed");
+        next_attempt = 0;
+    }
+
+    void Connect()
+    {
+        if (status != Status::DEAD || conninfo.empty())
+            return;
+
+        conn = PQconnectStart(conninfo.c_str());
+        if (!conn || PQstatus(conn) == CONNECTION_BAD || PQsetnonblocking(conn, 1) == -1)
+        {
+            Fail(conn ? PQerrorMessage(conn) : "out of memory");
+            return;
+        }
+
+        SetFd(PQsocket(conn));
+        if (!HasFd() || !SocketEngine::AddFd(this, FD_WANT_NO_READ | FD_WANT_NO_WRITE))
+        {
+            Fail("unable to add the socket to the socket engine");
+            return;
+        }
+
+        status = Status::CONNECTING;
+        connect_started = ServerInstance->Time();
+        PollConnect();
+    }
+
+    // Reconnects if the connection is down and the retry delay has passed,
+    // drops it if connecting or a query has hung, and probes it when it has
+    // been idle for ping_interval seconds. PQconnectPoll does not apply
+    // connect_timeout, so an unreachable host is given up on here.
+    void Check(time_t ping_interval)
+    {
+        time_t now = ServerInstance->Time();
+        if (status == Status::DEAD)
+        {
+            if (now >= next_attempt)
+                Connect();
+        }
+        else if (status == Status::CONNECTING)
+        {
+            if (now - connect_started >= QUERY_TIMEOUT)
+                Fail("connection timed out");
+        }
+        else if (status == Status::READY)
+        {
+            if (!inflight.empty() && now - sent_times.front() >= QUERY_TIMEOUT)
+            {
+                Fail("query timed out");
+            }
+            else if (inflight.empty() && queue.empty() && now - last_active >= ping_interval)
+            {
+                Submit("captcha_ping", {}, [this](PGresult* res)
+                {
+                    if (res && PQresultStatus(res) != PGRES_TUPLES_OK)
+                        Fail(PQresultErrorMessage(res));
+                });
+            }
+        }
+    }
+
+    bool IsReady() const
+    {
+        return status == Status::READY;
+    }
+
+    bool IsDead() const
+    {
+        return status == Status::DEAD;
+    }
+
+    size_t Pending() const
+    {
+        return queue.size() + inflight.size();
+    }
+
+    // Queues a prepared statement with binary parameters. If the connection
+    // is down the callback is called with a null result straight away.
+    void Submit(const char* name, const std::vector<std::string>& params, CaptchaCallback callback)
+    {
+        if (status == Status::DEAD)
+        {
+            callback(nullptr);
+            return;
+        }
+
+        for (const auto& statement : CAPTCHA_STATEMENTS)
+        {
+            if (!strcmp(statement.name, name))
+            {
+                queue.push_back({ &statement, false, params, std::move(callback) });
+                SendNext();
+                return;
+            }
+        }
+
+        callback(nullptr);
+    }
+
+    // Closes the connection without calling the callbacks of queued or sent
+    // queries.
+    void Close()
+    {
+        if (HasFd() && SocketEngine::HasFd(GetFd()))
+            SocketEngine::DelFd(this);
+        SetFd(-1);
+
+        if (result)
+        {
+            PQclear(result);
+            result = nullptr;
+        }
+
+        if (conn)
+        {
+            PQfinish(conn);
+            conn = nullptr;
+        }
+
+        sent_times.clear();
+        status = Status::DEAD;
+        pipeline = false;
+        probing = false;
+    }
+
+    void Shutdown()
+    {
+        queue.clear();
+        inflight.clear();
+        Close();
+    }
+
+    void OnEventHandlerRead() override
+    {
+        if (status == Status::CONNECTING)
+            PollConnect();
+        else if (status == Status::READY)
+            ReadResults();
+    }
+
+    void OnEventHandlerWrite() override
+    {
+        if (status == Status::CONNECTING)
+            PollConnect();
+        else if (status == Status::READY)
+            Flush();
+    }
+
+    void OnEventHandlerError(int errornum) override
+    {
+        Fail(strerror(errornum));
+    }
+};
+
+// A fixed number of connections to the same database. Queries go to the
+// least loaded ready connection, and one connection at a time listens for
+// allowlist changes.
+class CaptchaPool
+{
+private:
+    std::vector<std::unique_ptr<CaptchaDatabase>> connections;
+    CaptchaDatabase* listener = nullptr;
+    std::string conninfo;
+    time_t ping_interval = 60;
+    std::function<void(CaptchaDatabase&)> on_listen;
+    std::function<void(const std::string&)> on_notify;
+
+    void OnConnect(CaptchaDatabase* db)
+    {
+        if (listener)
+            return;
+
+        listener = db;
+        on_listen(*db);
+    }
+
+    void OnFail(CaptchaDatabase* db)
+    {
+        if (listener != db)
+            return;
+
+        // Hand listening over to another connection if one is up; otherwise
+        // the next one to connect takes it.
+        listener = nullptr;
+        for (const auto& connection : connections)
+        {
+            if (connection->IsReady())
+            {
+                OnConnect(connection.get());
+                break;
+            }
+        }
+    }
+
+public:
+    CaptchaPool(std::function<void(CaptchaDatabase&)> listen, std::function<void(const std::string&)> notified)
+        : on_listen(std::move(listen)), on_notify(std::move(notified))
+    {
+    }
+
+    void Configure(const std::string& info, size_t count, time_t interval)
+    {
+        conninfo = info;
+        ping_interval = interval;
+
+        while (connections.size() > count)
+        {
+            if (!connections.back()->IsDead())
+                connections.back()->Fail("connection pool shrunk");
+            connections.back()->Shutdown();
+            connections.pop_back();
+        }
+
+        while (connections.size() < count)
+        {
+            connections.push_back(std::make_unique<CaptchaDatabase>(
+                [this](CaptchaDatabase& db) { OnConnect(&db); },
+                [this](const std::string& payload) { on_notify(payload); },
+                [this](CaptchaDatabase& db) { OnFail(&db); }));
+        }
+
+        for (const auto& connection : connections)
+            connection->SetConnInfo(conninfo);
+    }
+
+    void Check()
+    {
+        for (const auto& connection : connections)
+            connection->Check(ping_interval);
+    }
+
+    bool IsReady() const
+    {
+        for (const auto& connection : connections)
+        {
+            if (connection->IsReady())
+                return true;
+        }
+        return false;
+    }
+
+    // Queues a query on the ready connection with the fewest queries waiting,
+    // or on one which is still connecting if none is ready.
+    void Submit(const char* name, const std::vector<std::string>& params, CaptchaCallback callback)
+    {
+        CaptchaDatabase* best = nullptr;
+        for (const auto& connection : connections)
+        {
+            if (connection->IsDead())
+                continue;
+
+            if (!best || (connection->IsReady() && !best->IsReady()) || (connection->IsReady() == best->IsReady() && connection->Pending() < best->Pending()))
+                best = connection.get();
+        }
+
+        if (!best)
+        {
+            callback(nullptr);
+            return;
+        }
+
+        best->Submit(name, params, std::move(callback));
+    }
+
+    // Reloads the allowlist on the listening connection, so notifications
+    // received meanwhile are not lost.
+    void Reload()
+    {
+        if (listener)
+            on_listen(*listener);
+    }
+
+    void Shutdown()
+    {
+        for (const auto& connection : connections)
+            connection->Shutdown();
+        listener = nullptr;
+    }
+};
+
+// An address as two 64-bit words, with IPv4 addresses mapped into IPv6.
+struct CaptchaKey
+{
+    uint64_t hi = 0;
+    uint64_t lo = 0;
+
+    CaptchaKey(const irc::sockets::sockaddrs& sa)
+    {
+        unsigned char bytes[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+        if (sa.family() == AF_INET6)
+            memcpy(bytes, &sa.in6.sin6_addr, 16);
+        else
+            memcpy(bytes + 12, &sa.in4.sin_addr, 4);
+        memcpy(&hi, bytes, 8);
+        memcpy(&lo, bytes + 8, 8);
+    }
+
+    CaptchaKey(const CaptchaPrefix& prefix)
+    {
+        unsigned char bytes[16];
+        CaptchaPrefix::Store64(prefix.hi, bytes);
+        CaptchaPrefix::Store64(prefix.lo, bytes + 8);
+        memcpy(&hi, bytes, 8);
+        memcpy(&lo, bytes + 8, 8);
+    }
+
+    bool operator==(const CaptchaKey& other) const
+    {
+        return hi == other.hi && lo == other.lo;
+    }
+};
+
+struct CaptchaKeyHash
+{
+    size_t operator()(const CaptchaKey& key) const
+    {
+        return std::hash<uint64_t>()((key.hi * 0x9E3779B97F4A7C15ULL) ^ key.lo);
+    }
+};
+
+// A fixed-capacity cache of verdicts for recently seen addresses. Entries
+// expire through a timer wheel with one slot per second, and the least
+// recently used entry is evicted when the cache is full. A check is a single
+// hash probe.
+class CaptchaCache
+{
+public:
+    struct Value
+    {
+        bool allowed;
+        unsigned long attempts; // Connections refused while this entry was cached
+    };
+
+private:
+    static constexpr uint32_t NONE = UINT32_MAX;
+    static constexpr size_t WHEEL_SLOTS = 256;
+
+    struct Link
+    {
+        uint32_t prev = NONE;
+        uint32_t next = NONE;
+    };
+
+    struct Entry
+    {
+        CaptchaKey key;
+        time_t expires;
+        Value value;
+        Link lru;
+        Link wheel;
+    };
+
+    std::vector<Entry> entries;
+    std::vector<uint32_t> free_entries;
+    std::unordered_map<CaptchaKey, uint32_t, CaptchaKeyHash> index;
+    std::vector<uint32_t> wheel = std::vector<uint32_t>(WHEEL_SLOTS, NONE);
+    uint32_t lru_head = NONE; // Most recently used
+    uint32_t lru_tail = NONE; // Least recently used
+    size_t capacity = 0;
+    time_t last_expire = 0;
+
+    void Unlink(uint32_t id, Link Entry::*member, uint32_t& head, uint32_t* tail)
+    {
+        Link& link = entries[id].*member;
+        if (link.prev != NONE)
+            (entries[link.prev].*member).next = link.next;
+        else
+            head = link.next;
+
+        if (link.next != NONE)
+            (entries[link.next].*member).prev = link.prev;
+        else if (tail)
+            *tail = link.prev;
+
+        link = Link();
+    }
+
+    void PushFront(uint32_t id, Link Entry::*member, uint32_t& head, uint32_t* tail)
+    {
+        Link& link = entries[id].*member;
+        link.prev = NONE;
+        link.next = head;
+        if (head != NONE)
+            (entries[head].*member).prev = id;
+        else if (tail)
+            *tail = id;
+        head = id;
+    }
+
+    uint32_t& Slot(time_t expires)
+    {
+        return wheel[static_cast<size_t>(expires) % WHEEL_SLOTS];
+    }
+
+    void Remove(uint32_t id)
+    {
+        Entry& entry = entries[id];
+        Unlink(id, &Entry::lru, lru_head, &lru_tail);
+        Unlink(id, &Entry::wheel, Slot(entry.expires), nullptr);
+        index.erase(entry.key);
+        free_entries.push_back(id);
+    }
+
+public:
+    // Empties the cache and sets how many addresses it may hold. A capacity
+    // of zero disables it.
+    void Reset(size_t newcapacity)
+    {
+        entries.clear();
+        free_entries.clear();
+        index.clear();
+        std::fill(wheel.begin(), wheel.end(), NONE);
+        lru_head = lru_tail = NONE;
+        capacity = newcapacity;
+        entries.reserve(capacity);
+        index.reserve(capacity);
+    }
+
+    size_t Size() const
+    {
+        return index.size();
+    }
+
+    // Returns the cached verdict for an address, or null if there is none.
+    Value* Find(const CaptchaKey& key, time_t now)
+    {
+        auto it = index.find(key);
+        if (it == index.end())
+            return nullptr;
+
+        uint32_t id = it->second;
+        if (entries[id].expires <= now)
+        {
+            Remove(id);
+            return nullptr;
+        }
+
+        Unlink(id, &Entry::lru, lru_head, &lru_tail);
+        PushFront(id, &Entry::lru, lru_head, &lru_tail);
+        return &entries[id].value;
+    }
+
+    // Caches a verdict, replacing any existing one. Returns null if the cache
+    // is disabled.
+    Value* Insert(const CaptchaKey& key, bool allowed, time_t expires)
+    {
+        if (!capacity)
+            return nullptr;
+
+        auto [it, inserted] = index.try_emplace(key, NONE);
+        uint32_t id = it->second;
+        if (inserted)
+        {
+            if (index.size() > capacity)
+                Remove(lru_tail);
+
+            if (free_entries.empty())
+            {
+                id = static_cast<uint32_t>(entries.size());
+                entries.push_back({ key, expires, { allowed, 0 }, Link(), Link() });
+            }
+            else
+            {
+                id = free_entries.back();
+                free_entries.pop_back();
+                entries[id] = { key, expires, { allowed, 0 }, Link(), Link() };
+            }
+            it->second = id;
+        }
+        else
+        {
+            Unlink(id, &Entry::lru, lru_head, &lru_tail);
+            Unlink(id, &Entry::wheel, Slot(entries[id].expires), nullptr);
+            entries[id].expires = expires;
+            entries[id].value = { allowed, 0 };
+        }
+
+        PushFront(id, &Entry::lru, lru_head, &lru_tail);
+        PushFront(id, &Entry::wheel, Slot(expires), nullptr);
+        return &entries[id].value;
+    }
+
+    void Erase(const CaptchaKey& key)
+    {
+        auto it = index.find(key);
+        if (it != index.end())
+            Remove(it->second);
+    }
+
+    // Drops the entries that expired since the last call. Entries in a slot
+    // which expire on a later turn of the wheel are left in place.
+    void Expire(time_t now)
+    {
+        if (!last_expire || now - last_expire > static_cast<time_t>(WHEEL_SLOTS))
+            last_expire = now - WHEEL_SLOTS;
+
+        for (time_t second = last_expire + 1; second <= now; ++second)
+        {
+            uint32_t id = Slot(second);
+            while (id != NONE)
+            {
+                uint32_t next = entries[id].wheel.next;
+                if (entries[id].expires <= now)
+                    Remove(id);
+                id = next;
+            }
+        }
+        last_expire = now;
+    }
+};
+
+// Streams the allowlist to or from a file with COPY on a connection of its
+// own, as COPY cannot share a pipelined connection. Imports go through a
+// temporary table so addresses already in the allowlist are skipped.
+class CaptchaCopy : public EventHandler
+{
+public:
+    typedef std::function<void(const std::string& message)> Reporter;
+    typedef std::function<void(bool success)> Finisher;
+
+private:
+    enum class Stage
+    {
+        CONNECTING,
+        COPY_IN,
+        COPY_OUT,
+        WAITING,
+        DONE
+    };
+
+    static constexpr size_t CHUNK_SIZE = 65536;
+    static constexpr size_t PROGRESS_ROWS = 10000;
+
+    PGconn* conn = nullptr;
+    Stage stage = Stage::CONNECTING;
+    bool importing;
+    bool merging = false;
+    std::vector<std::string> rows; // Addresses to import
+    size_t next_row = 0;
+    std::string chunk;             // Import data waiting for room in the send buffer
+    FILE* out = nullptr;           // Export file
+    size_t copied = 0;
+    std::string inserted = "0";
+    Reporter report;
+    Finisher finish;
+
+    void Progress(size_t before, size_t after)
+    {
+        if (before / PROGRESS_ROWS != after / PROGRESS_ROWS)
+            report(INSP_FORMAT("{} {} rows so far...", importing ? "Sent" : "Exported", after));
+    }
+
+    void Finish(bool success, const std::string& message)
+    {
+        if (stage == Stage::DONE)
+            return;
+
+        stage = Stage::DONE;
+        report(message);
+        Close();
+        finish(success);
+        ServerInstance->GlobalCulls.AddItem(this);
+    }
+
+    void Flush()
+    {
+        int flushed = PQflush(conn);
+        if (flushed < 0)
+            Finish(false, INSP_FORMAT("Connection failed: {}", PQerrorMessage(conn)));
+        else if (flushed > 0)
+            SocketEngine::ChangeEventMask(this, FD_WANT_POLL_READ | FD_WANT_POLL_WRITE);
+        else
+            SocketEngine::ChangeEventMask(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+    }
+
+    void PollConnect()
+    {
+        switch (PQconnectPoll(conn))
+        {
+            case PGRES_POLLING_WRITING:
+                SocketEngine::ChangeEventMask(this, FD_WANT_POLL_WRITE | FD_WANT_NO_READ);
+                break;
+
+            case PGRES_POLLING_READING:
+                SocketEngine::ChangeEventMask(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+                break;
+
+            case PGRES_POLLING_FAILED:
+                Finish(false, INSP_FORMAT("Unable to connect: {}", PQerrorMessage(conn)));
+                break;
+
+            case PGRES_POLLING_OK:
+                Send(importing
+                    ? "CREATE TEMP TABLE captcha_import (ip_address inet); COPY captcha_import (ip_address) FROM STDIN"
+                    : "COPY (SELECT ip_address FROM ircaccess_alloweduser) TO STDOUT");
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    void Send(const char* sql)
+    {
+        stage = Stage::WAITING;
+        if (!PQsendQuery(conn, sql))
+        {
+            Finish(false, INSP_FORMAT("Unable to send query: {}", PQerrorMessage(conn)));
+            return;
+        }
+        Flush();
+    }
+
+    void SendRows()
+    {
+        while (stage == Stage::COPY_IN)
+        {
+            if (chunk.empty())
+            {
+                if (next_row == rows.size())
+                {
+                    int ended = PQputCopyEnd(conn, nullptr);
+                    if (ended < 0)
+                    {
+                        Finish(false, INSP_FORMAT("Unable to finish the import: {}", PQerrorMessage(conn)));
+                        return;
+                    }
+
+                    if (ended > 0)
+                        stage = Stage::WAITING;
+                    break;
+                }
+
+                while (next_row < rows.size() && chunk.size() < CHUNK_SIZE)
+                    chunk.append(rows[next_row++]).push_back('\n');
+            }
+
+            int put = PQputCopyData(conn, chunk.data(), static_cast<int>(chunk.size()));
+            if (put < 0)
+            {
+                Finish(false, INSP_FORMAT("Unable to send rows: {}", PQerrorMessage(conn)));
+                return;
+            }
+
+            // The send buffer is full; carry on when the socket is writable.
+            if (put == 0)
+                break;
+
+            Progress(copied, next_row);
+            copied = next_row;
+            chunk.clear();
+        }
+
+        Flush();
+
+        // Rows still waiting to be queued are sent when the socket is writable.
+        if (stage == Stage::COPY_IN)
+            SocketEngine::ChangeEventMask(this, FD_WANT_POLL_READ | FD_WANT_POLL_WRITE);
+    }
+
+    void ReadCopyData()
+    {
+        char* buffer;
+        int length;
+        while ((length = PQgetCopyData(conn, &buffer, 1)) > 0)
+        {
+            bool written = fwrite(buffer, 1, length, out) == static_cast<size_t>(length);
+            PQfreemem(buffer);
+            if (!written)
+            {
+                Finish(false, INSP_FORMAT("Unable to write to the export file: {}", strerror(errno)));
+                return;
+            }
+
+            Progress(copied, copied + 1);
+            copied++;
+        }
+
+        if (length == -1)
+            stage = Stage::WAITING;
+        else if (length == -2)
+            Finish(false, INSP_FORMAT("Export failed: {}", PQerrorMessage(conn)));
+    }
+
+    void ReadResults()
+    {
+        if (!PQconsumeInput(conn))
+        {
+            Finish(false, INSP_FORMAT("Connection failed: {}", PQerrorMessage(conn)));
+            return;
+        }
+
+        if (stage == Stage::COPY_OUT)
+            ReadCopyData();
+
+        while (stage == Stage::WAITING && !PQisBusy(conn))
+        {
+            PGresult* res = PQgetResult(conn);
+            if (!res)
+            {
+                // Every statement sent so far has finished.
+                if (!importing)
+                {
+                    fflush(out);
+                    Finish(true, INSP_FORMAT("Exported {} allowlist entries.", copied));
+                }
+                else if (!merging)
+                {
+                    merging = true;
+                    Send("INSERT INTO ircaccess_alloweduser (ip_address) SELECT DISTINCT c.ip_address FROM captcha_import c"
+                        " WHERE NOT EXISTS (SELECT 1 FROM ircaccess_alloweduser a WHERE a.ip_address = c.ip_address); DROP TABLE captcha_import");
+                }
+                else
+                {
+                    Finish(true, INSP_FORMAT("Imported {} new allowlist entries from {} rows.", inserted, rows.size()));
+                }
+                return;
+            }
+
+            ExecStatusType status = PQresultStatus(res);
+            if (status == PGRES_COPY_IN)
+            {
+                PQclear(res);
+                stage = Stage::COPY_IN;
+                SendRows();
+                return;
+            }
+
+            if (status == PGRES_COPY_OUT)
+            {
+                PQclear(res);
+                stage = Stage::COPY_OUT;
+                ReadCopyData();
+                continue;
+            }
+
+            if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK)
+            {
+                std::string error = PQresultErrorMessage(res);
+                PQclear(res);
+                Finish(false, INSP_FORMAT("{} failed: {}", importing ? "Import" : "Export", error));
+                return;
+            }
+
+            if (merging && !strncmp(PQcmdStatus(res), "INSERT", 6))
+                inserted = PQcmdTuples(res);
+            PQclear(res);
+        }
+    }
+
+    void Close()
+    {
+        if (HasFd() && SocketEngine::HasFd(GetFd()))
+            SocketEngine::DelFd(this);
+        SetFd(-1);
+
+        if (conn)
+        {
+            PQfinish(conn);
+            conn = nullptr;
+        }
+
+        if (out)
+        {
+            fclose(out);
+            out = nullptr;
+        }
+    }
+
+public:
+    CaptchaCopy(bool import, Reporter reporter, Finisher finisher)
+        : importing(import), report(std::move(reporter)), finish(std::move(finisher))
+    {
+    }
+
+    ~CaptchaCopy() override
+    {
+        Close();
+    }
+
+    // Reads the addresses to import, one address or prefix per line. Blank
+    // lines and lines starting with # are skipped.
+    bool ReadFile(const std::string& path, std::string& error)
+    {
+        std::ifstream stream(path);
+        if (!stream.is_open())
+        {
+            error = INSP_FORMAT("Unable to open {}: {}", path, strerror(errno));
+            return false;
+        }
+
+        std::string line;
+        size_t invalid = 0;
+        while (std::getline(stream, line))
+        {
+            line.erase(0, line.find_first_not_of(" \t"));
+            line.erase(line.find_last_not_of(" \t\r") + 1);
+            if (line.empty() || line[0] == '#')
+                continue;
+
+            CaptchaPrefix prefix;
+            if (CaptchaPrefix::Parse(line, prefix))
+                rows.push_back(line);
+            else
+                invalid++;
+        }
+
+        if (invalid)
+            report(INSP_FORMAT("Skipped {} invalid lines in {}.", invalid, path));
+        return true;
+    }
+
+    bool OpenFile(const std::string& path, std::string& error)
+    {
+        out = fopen(path.c_str(), "w");
+        if (!out)
+        {
+            error = INSP_FORMAT("Unable to open {}: {}", path, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    size_t Rows() const
+    {
+        return rows.size();
+    }
+
+    bool Start(const std::string& conninfo, std::string& error)
+    {
+        conn = PQconnectStart(conninfo.c_str());
+        if (!conn || PQstatus(conn) == CONNECTION_BAD || PQsetnonblocking(conn, 1) == -1)
+        {
+            error = conn ? PQerrorMessage(conn) : "out of memory";
+            Close();
+            return false;
+        }
+
+        SetFd(PQsocket(conn));
+        if (!HasFd() || !SocketEngine::AddFd(this, FD_WANT_NO_READ | FD_WANT_NO_WRITE))
+        {
+            error = "unable to add the socket to the socket engine";
+            Close();
+            return false;
+        }
+
+        PollConnect();
+        return true;
+    }
+
+    void OnEventHandlerRead() override
+    {
+        if (stage == Stage::CONNECTING)
+            PollConnect();
+        else if (stage != Stage::DONE)
+            ReadResults();
+    }
+
+    void OnEventHandlerWrite() override
+    {
+        if (stage == Stage::CONNECTING)
+            PollConnect();
+        else if (stage == Stage::COPY_IN)
+            SendRows();
+        else if (stage != Stage::DONE)
+            Flush();
+    }
+
+    void OnEventHandlerError(int errornum) override
+    {
+        Finish(false, INSP_FORMAT("Connection failed: {}", strerror(errornum)));
+    }
+};
+
+// Verifies tokens issued by the web verify page so a user can connect as
+// soon as they have solved the captcha, without a database round trip. A
+// token looks like:
+//
+//   <ip>[/<length>]:<expiry>:<nonce>:<signature>
+//
+// where expiry is a UNIX timestamp, nonce is any string without colons that
+// is unique per token and signature is the lowercase hex HMAC-SHA256 of
+// everything before the last colon, keyed with <captchaconfig:tokenkey>.
+// Each nonce is accepted once.
+class CaptchaTokens
+{
+private:
+    // Tokens expiring later than this are refused so the nonce set stays small.
+    static constexpr time_t MAX_TOKEN_LIFETIME = 3600;
+
+    std::string key;
+    std::unordered_map<std::string, time_t> nonces;
+
+public:
+    void SetKey(const std::string& newkey)
+    {
+        key = newkey;
+    }
+
+    bool IsEnabled() const
+    {
+        return !key.empty();
+    }
+
+    bool Verify(HashProvider* sha256, const std::string& token, const irc::sockets::sockaddrs& sa, time_t now, CaptchaPrefix& prefix, time_t& expiry, std::string& error)
+    {
+        if (!sha256)
+        {
+            error = "token verification is unavailable";
+            return false;
+        }
+
+        // The address may itself contain colons, so the token is split from the end.
+        std::string::size_type sigpos = token.rfind(':');
+        std::string::size_type noncepos = sigpos && sigpos != std::string::npos ? token.rfind(':', sigpos - 1) : std::string::npos;
+        std::string::size_type expirypos = noncepos && noncepos != std::string::npos ? token.rfind(':', noncepos - 1) : std::string::npos;
+        if (expirypos == std::string::npos)
+        {
+            error = "malformed token";
+            return false;
+        }
+
+        std::string expirystr = token.substr(expirypos + 1, noncepos - expirypos - 1);
+        std::string nonce = token.substr(noncepos + 1, sigpos - noncepos - 1);
+        if (!CaptchaPrefix::Parse(token.substr(0, expirypos), prefix) || nonce.empty()
+            || expirystr.empty() || expirystr.size() > 19 || expirystr.find_first_not_of("0123456789") != std::string::npos)
+        {
+            error = "malformed token";
+            return false;
+        }
+
+        std::string signature = Hex::Encode(sha256->hmac(key, token.substr(0, sigpos)));
+        if (!InspIRCd::TimingSafeCompare(signature, token.substr(sigpos + 1)))
+        {
+            error = "invalid signature";
+            return false;
+        }
+
+        expiry = ConvToNum<time_t>(expirystr);
+        if (expiry <= now)
+        {
+            error = "token has expired";
+            return false;
+        }
+
+        if (expiry > now + MAX_TOKEN_LIFETIME)
+        {
+            error = "token expires too far in the future";
+            return false;
+        }
+
+        if (CaptchaPrefix(sa).Common(prefix, prefix.length) < prefix.length)
+        {
+            error = "token was issued for a different address";
+            return false;
+        }
+
+        if (!nonces.emplace(nonce, expiry).second)
+        {
+            error = "token has already been used";
+            return false;
+        }
+
+        return true;
+    }
+
+    void Expire(time_t now)
+    {
+        for (auto it = nonces.begin(); it != nonces.end(); )
+        {
+            if (it->second <= now)
+                it = nonces.erase(it);
+            else
+                ++it;
+        }
+    }
+};
+
+// Reconnects the database and expires cached verdicts and token nonces.
+class CaptchaTimer : public Timer
+{
+private:
+    std::function<void()> callback;
+
+public:
+    CaptchaTimer(std::function<void()> cb)
+        : Timer(1, true), callback(std::move(cb))
+    {
+    }
+
+    bool Tick() override
+    {
+        callback();
+        return true;
+    }
+};
+
+// Where a connecting user's reCAPTCHA check is.
+struct CaptchaState
+{
+    enum Verdict
+    {
+        PENDING,
+        ALLOWED,
+        DENIED
+    };
+
+    Verdict verdict = PENDING;
+    time_t started = 0;
+    time_t held = 0;      // When registration started being held for an unsolved captcha, or 0
+    time_t rechecked = 0; // When the database was last asked about a held user
+};
+
 class ModuleCaptchaCheck : public Module
 {
 private:
     std::string conninfo;
     std::string captcha_url;
-    PGconn* db;
+    CaptchaAllowlist allowlist;
+    CaptchaPool db;
+    CaptchaTimer timer;
     std::unordered_set<int> ports;
-    std::unordered_map<std::string, std::chrono::steady_clock::time_point> ip_cache;
+    CaptchaCache ip_cache;
+    SimpleExtItem<CaptchaState> captcha_state;
+    time_t check_timeout;
+    time_t cache_duration;
+    time_t negative_duration;
+    size_t cache_size = 0;
+    unsigned long max_attempts;
+    CaptchaTokens tokens;
+    bool token_persist;
+    dynamic_reference_nocheck<HashProvider> sha256;
+
+    bool hold;
+    time_t hold_timeout;
+    CaptchaCopy* copy_job = nullptr;
+    time_t cleanup_interval;
+    time_t last_cleanup = 0;
+    unsigned int loading = 0;                    // Allowlist loads in flight
+    std::vector<std::string> deferred_notifies;  // Changes notified during a load
 
-    static constexpr int CACHE_DURATION_MINUTES = 10;
     static constexpr int MAX_ALLOWED_REQUESTS = 5;
-    static constexpr size_t IRC_MAX_LENGTH = 512;
+    static constexpr unsigned long CLEANUP_BATCH = 1000;
+    static constexpr time_t HOLD_RECHECK_INTERVAL = 5;
+    static constexpr time_t HOLD_MARGIN = 5;
+
+    static bool IsSASLAuthenticated(LocalUser* user)
+    {
+        SimpleExtItem<std::string>* saslExt = static_cast<SimpleExtItem<std::string>*>(
+            ServerInstance->Extensions.GetItem("sasl-state"));
+        return saslExt && saslExt->Get(user);
+    }
+
+    // Keeps an unverified user registering while they solve the captcha,
+    // until they show up in the allowlist or present a token. When the hold
+    // times out they are refused.
+    ModResult Hold(LocalUser* user, CaptchaState& state)
+    {
+        time_t now = ServerInstance->Time();
+        if (!state.held)
+        {
+            state.held = now;
+            state.rechecked = now;
+
+            std::string error;
+            if (tokens.IsEnabled() && !user->password.empty() && AcceptToken(user, user->password, error))
+                return MOD_RES_PASSTHRU;
+
+            user->WriteNotice("*** reCAPTCHA: You must solve a Google reCAPTCHA to connect. Please visit " + captcha_url + " and your connection will continue automatically once you have.");
+            if (tokens.IsEnabled())
+                user->WriteNotice("*** reCAPTCHA: If the page gives you a token, send it with /QUOTE RECAPTCHA TOKEN <token>");
+        }
+
+        if (allowlist.IsLoaded() && allowlist.Contains(user->client_sa))
+        {
+            state.verdict = CaptchaState::ALLOWED;
+            ip_cache.Insert(CaptchaKey(user->client_sa), true, now + cache_duration);
+            ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("*** reCAPTCHA: Held user {} solved the reCAPTCHA (IP: {})", user->nick, user->client_sa.addr()));
+            return MOD_RES_PASSTHRU;
+        }
+
+        // Give up a little before the connect class's registration timeout so
+        // the user is refused with the captcha notice rather than timed out.
+        time_t deadline = std::min<time_t>(state.held + hold_timeout, user->signon + user->GetClass()->connection_timeout - HOLD_MARGIN);
+        if (now >= deadline)
+            return Refuse(user);
+
+        // Without the replica the database is asked again every few seconds.
+        if (!allowlist.IsLoaded() && now - state.rechecked >= HOLD_RECHECK_INTERVAL)
+        {
+            state.rechecked = now;
+            std::string uuid = user->uuid;
+            CaptchaKey key(user->client_sa);
+            db.Submit("captcha_check", { EncodeInet(user->client_sa) }, [this, uuid, key](PGresult* res)
+            {
+                if (res && PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) > 0)
+                {
+                    ip_cache.Insert(key, true, ServerInstance->Time() + cache_duration);
+                    SetVerdict(uuid, key, CaptchaState::ALLOWED);
+                }
+            });
+        }
+
+        return MOD_RES_DENY;
+    }
+
+    // Applies the result of a check of the address in key. If the user's
+    // address changed while it ran (WEBIRC, HAProxy) the result is dropped;
+    // the change started a check of the new address.
+    void SetVerdict(const std::string& uuid, const CaptchaKey& key, CaptchaState::Verdict verdict)
+    {
+        LocalUser* user = IS_LOCAL(ServerInstance->Users.FindUUID(uuid));
+        if (!user || !(CaptchaKey(user->client_sa) == key))
+            return;
+
+        CaptchaState* state = captcha_state.Get(user);
+        if (state)
+            state->verdict = verdict;
+    }
+
+    // Starts an asynchronous allowlist check for a user on a protected port.
+    // Registration is held in OnCheckReady until the verdict is in.
+    void StartCheck(LocalUser* user)
+    {
+        if (ports.find(user->server_sa.port()) == ports.end())
+        {
+            // A gateway may have moved the user off a protected port.
+            captcha_state.Unset(user);
+            return;
+        }
+
+        time_t now = ServerInstance->Time();
+        CaptchaKey key(user->client_sa);
+        CaptchaCache::Value* cached = ip_cache.Find(key, now);
+
+        // Once the allowlist has been loaded checks never wait on the database.
+        if (!cached && allowlist.IsLoaded())
+        {
+            bool allowed = allowlist.Contains(user->client_sa);
+            cached = ip_cache.Insert(key, allowed, now + (allowed ? cache_duration : negative_duration));
+            if (!cached)
+            {
+                captcha_state.Set(user, { allowed ? CaptchaState::ALLOWED : CaptchaState::DENIED, now });
+                return;
+            }
+        }
+
+        if (cached)
+        {
+            captcha_state.Set(user, { cached->allowed ? CaptchaState::ALLOWED : CaptchaState::DENIED, now });
+            return;
+        }
+
+        captcha_state.Set(user, { CaptchaState::PENDING, now });
+
+        std::string ip = user->client_sa.addr();
+        std::string uuid = user->uuid;
+        db.Submit("captcha_check", { EncodeInet(user->client_sa) }, [this, uuid, ip, key](PGresult* res)
+        {
+            if (!res || PQresultStatus(res) != PGRES_TUPLES_OK)
+            {
+                // Allow connections if the database is unavailable or the query fails.
+                ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Check for {} failed, skipping reCAPTCHA check: {}", ip, res ? PQresultErrorMessage(res) : "database unavailable"));
+                SetVerdict(uuid, key, CaptchaState::ALLOWED);
+                return;
+            }
+
+            bool allowed = PQntuples(res) > 0;
+            ip_cache.Insert(key, allowed, ServerInstance->Time() + (allowed ? cache_duration : negative_duration));
+            SetVerdict(uuid, key, allowed ? CaptchaState::ALLOWED : CaptchaState::DENIED);
+        });
+    }
+
+    // Subscribes to allowlist changes and then loads the whole table, so no
+    // change made in between is missed.
+    void OnDatabaseListen(CaptchaDatabase& conn)
+    {
+        conn.Submit("captcha_listen", {}, [](PGresult* res)
+        {
+            if (!res || PQresultStatus(res) != PGRES_COMMAND_OK)
+                ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Failed to listen for allowlist changes: {}", res ? PQresultErrorMessage(res) : "database unavailable"));
+        });
 
-    PGconn* GetConnection()
+        loading++;
+        conn.Submit("captcha_load", {}, [this](PGresult* res)
+        {
+            loading--;
+            if (!res || PQresultStatus(res) != PGRES_TUPLES_OK)
+            {
+                ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Failed to load the allowlist: {}", res ? PQresultErrorMessage(res) : "database unavailable"));
+            }
+            else
+            {
+                allowlist.Load(res, ServerInstance->Time());
+                ip_cache.Reset(cache_size);
+                ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Loaded {} allowed IP addresses and ranges.", allowlist.Size()));
+            }
+
+            // Changes notified while the load ran may be newer than it.
+            if (!loading)
+            {
+                std::vector<std::string> payloads;
+                payloads.swap(deferred_notifies);
+                for (const auto& payload : payloads)
+                    OnDatabaseNotify(payload);
+            }
+        });
+    }
+
+    // Lets a user in with a token from the web verify page, and remembers
+    // the verdict for the address until the token expires.
+    bool AcceptToken(LocalUser* user, const std::string& token, std::string& error)
+    {
+        time_t now = ServerInstance->Time();
+        CaptchaPrefix prefix;
+        time_t expiry;
+        if (!tokens.Verify(sha256 ? *sha256 : nullptr, token, user->client_sa, now, prefix, expiry, error))
+            return false;
+
+        CaptchaState* state = captcha_state.Get(user);
+        if (state)
+            state->verdict = CaptchaState::ALLOWED;
+        else
+            captcha_state.Set(user, { CaptchaState::ALLOWED, now });
+        ip_cache.Insert(CaptchaKey(user->client_sa), true, expiry);
+
+        if (token_persist)
+        {
+            std::string entry = user->client_sa.addr();
+            db.Submit("captcha_add", { prefix.ToInet(), EncodeInt8(0) }, [entry](PGresult* res)
+            {
+                if (!res || PQresultStatus(res) != PGRES_COMMAND_OK)
+                    ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Failed to store the token for {}: {}", entry, res ? PQresultErrorMessage(res) : "database unavailable"));
+            });
+        }
+
+        ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("*** reCAPTCHA: Accepted a token for {} (IP: {})", user->nick, user->client_sa.addr()));
+        return true;
+    }
+
+    // Starts importing the allowlist from or exporting it to a file in the
+    // data directory, reporting progress to the user who asked. The name
+    // may not leave the data directory.
+    bool StartCopy(User* user, bool import, const std::string& file)
+    {
+        if (file.empty() || file.find_first_of("/\\") != std::string::npos || file.find("..") != std::string::npos)
+        {
+            user->WriteNotice("*** reCAPTCHA: The file must be a plain file name in the data directory.");
+            return false;
+        }
+
+        if (copy_job)
+        {
+            user->WriteNotice("*** reCAPTCHA: An import or export is already running.");
+            return false;
+        }
+
+        std::string uuid = user->uuid;
+        auto reporter = [uuid](const std::string& message)
+        {
+            User* target = ServerInstance->Users.FindUUID(uuid);
+            if (target)
+                target->WriteNotice("*** reCAPTCHA: " + message);
+        };
+
+        CaptchaCopy* job = new CaptchaCopy(import, reporter, [this, import](bool success)
+        {
+            copy_job = nullptr;
+            if (import && success)
+                db.Reload();
+        });
+
+        std::string path = ServerInstance->Config->Paths.PrependData(file);
+        std::string error;
+        if (!(import ? job->ReadFile(path, error) : job->OpenFile(path, error)) || !job->Start(conninfo, error))
+        {
+            delete job;
+            reporter(error);
+            return false;
+        }
+
+        // The job may already have finished if the connection failed at once.
+        if (job->HasFd())
+            copy_job = job;
+        reporter(import ? INSP_FORMAT("Importing {} rows from {}...", job->Rows(), path) : INSP_FORMAT("Exporting the allowlist to {}...", path));
+        return true;
+    }
+
+    // Forgets the cached verdicts for a prefix so a newly verified user can
+    // connect at once. Verdicts for a range are not indexed, so the whole
+    // cache is dropped.
+    void ForgetVerdicts(const CaptchaPrefix& prefix)
     {
-        if (!db || PQstatus(db) != CONNECTION_OK)
+        if (prefix.length == 128)
+            ip_cache.Erase(CaptchaKey(prefix));
+        else
+            ip_cache.Reset(cache_size);
+    }
+
+    // Deletes expired allowlist entries from the database in batches of
+    // CLEANUP_BATCH rows, going on until a batch comes back short.
+    void Cleanup()
+    {
+        db.Submit("captcha_cleanup", { EncodeInt8(CLEANUP_BATCH) }, [this](PGresult* res)
         {
-            db = PQconnectdb(conninfo.c_str());
-            if (PQstatus(db) != CONNECTION_OK)
+            if (!res || PQresultStatus(res) != PGRES_COMMAND_OK)
             {
-                ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Failed to connect to PostgreSQL database: {}", PQerrorMessage(db)));
-                return nullptr;
+                ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Failed to delete expired allowlist entries: {}", res ? PQresultErrorMessage(res) : "database unavailable"));
+                return;
             }
+
+            unsigned long deleted = ConvToNum<unsigned long>(PQcmdTuples(res));
+            if (deleted)
+                ServerInstance->Logs.Debug(MODNAME, INSP_FORMAT("Deleted {} expired allowlist entries.", deleted));
+            if (deleted >= CLEANUP_BATCH)
+                Cleanup();
+        });
+    }
+
+    void OnDatabaseNotify(const std::string& payload)
+    {
+        // A load in flight would replace the change, so it waits until then.
+        if (loading)
+        {
+            deferred_notifies.push_back(payload);
+            return;
         }
-        return db;
+
+        CaptchaPrefix prefix;
+        if (!allowlist.Apply(payload, prefix))
+        {
+            ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Ignoring malformed allowlist notification: {}", payload));
+            return;
+        }
+
+        ForgetVerdicts(prefix);
     }
 
 public:
     ModuleCaptchaCheck()
-        : Module(VF_VENDOR, "Requires users to solve a Google reCAPTCHA before connecting with PostgreSQL.."), db(nullptr)
+        : Module(VF_VENDOR, "Requires users to solve a Google reCAPTCHA before connecting with PostgreSQL..")
+        , db([this](CaptchaDatabase& conn) { OnDatabaseListen(conn); }, [this](const std::string& payload) { OnDatabaseNotify(payload); })
+        , timer([this]()
+        {
+            time_t now = ServerInstance->Time();
+            db.Check();
+
+            std::vector<CaptchaPrefix> expired;
+            allowlist.Expire(now, expired);
+            for (const auto& prefix : expired)
+                ForgetVerdicts(prefix);
+
+            if (cleanup_interval && db.IsReady() && now - last_cleanup >= cleanup_interval)
+            {
+                last_cleanup = now;
+                Cleanup();
+            }
+
+            ip_cache.Expire(now);
+            tokens.Expire(now);
+        })
+        , captcha_state(this, "captcha-state", ExtensionType::USER)
+        , sha256(this, "hash/sha256")
     {
     }
 
@@ -79,6 +2343,23 @@ public:
             throw ModuleException(this, "<captchaconfig:url> is a required configuration option.");
         }
 
+        check_timeout = tag->getDuration("timeout", 10, 1, 300);
+        cache_duration = tag->getDuration("cacheduration", 600, 1);
+        negative_duration = tag->getDuration("negativeduration", 30, 1);
+        max_attempts = tag->getNum<unsigned long>("maxattempts", MAX_ALLOWED_REQUESTS, 1);
+        tokens.SetKey(tag->getString("tokenkey"));
+        token_persist = tag->getBool("tokenpersist");
+        hold = tag->getBool("hold");
+        hold_timeout = tag->getDuration("holdtimeout", 60, 10);
+        cleanup_interval = tag->getDuration("cleanupinterval", 3600);
+
+        size_t cachesize = tag->getNum<size_t>("cachesize", 65536, 0);
+        if (cachesize != cache_size)
+        {
+            cache_size = cachesize;
+            ip_cache.Reset(cache_size);
+        }
+
         ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Configured PostgreSQL connection info: {}", conninfo));
         ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Configured reCAPTCHA URL: {}", captcha_url));
 
@@ -93,102 +2374,108 @@ public:
             ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Added port {} to reCAPTCHA check list", portnum));
         }
 
-        db = GetConnection();
+        db.Configure(conninfo, tag->getNum<size_t>("connections", 2, 1, 16), tag->getDuration("pinginterval", 60, 5));
+        db.Check();
     }
 
-    void OnUnloadModule(Module* mod) override
+    void OnChangeRemoteAddress(LocalUser* user) override
     {
-        if (db)
+        if (!user->client_sa.is_ip())
+            return;
+
+        // Unverified clients tend to reconnect in a tight loop. An address
+        // refused maxattempts times is turned away before DNS, ident and
+        // registration are spent on it, until its negative verdict expires.
+        // SASL is not known yet, so this briefly catches SASL users sharing
+        // the address too; the refusals it counts never include them.
+        if (ports.find(user->server_sa.port()) != ports.end())
         {
-            PQfinish(db);
+            CaptchaCache::Value* cached = ip_cache.Find(CaptchaKey(user->client_sa), ServerInstance->Time());
+            if (cached && !cached->allowed && cached->attempts >= max_attempts)
+            {
+                ServerInstance->Users.QuitUser(user, "*** reCAPTCHA: Too many connection attempts. Please solve the Google reCAPTCHA at " + captcha_url + " before reconnecting.");
+                return;
+            }
         }
+
+        // Start the check as early as possible so it overlaps with DNS and ident.
+        StartCheck(user);
     }
 
-    bool CheckCaptcha(const std::string& ip)
+    // Registration finishes once every module is ready, which is after
+    // NICK, USER and any SASL exchange, so this is where the verdict is
+    // enforced. A verdict which arrives after NICK and USER is still caught.
+    ModResult OnCheckReady(LocalUser* user) override
     {
-        auto now = std::chrono::steady_clock::now();
-
-        // Check cache
-        if (ip_cache.find(ip) != ip_cache.end() && now < ip_cache[ip])
-        {
-            return true;
-        }
-
-        PGconn* conn = GetConnection();
-        if (!conn)
+        CaptchaState* state = captcha_state.Get(user);
+        if (!state && user->client_sa.is_ip())
         {
-            ServerInstance->Logs.Normal(MODNAME, "Database connection unavailable, skipping reCAPTCHA check.");
-            return true; // Allow connections if database is unavailable
+            StartCheck(user);
+            state = captcha_state.Get(user);
         }
 
-        std::string query = INSP_FORMAT("SELECT COUNT(*) FROM ircaccess_alloweduser WHERE ip_address = '{}'", ip);
-        PGresult* res = PQexec(conn, query.c_str());
+        if (!state || state->verdict == CaptchaState::ALLOWED)
+            return MOD_RES_PASSTHRU;
 
-        if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        if (IsSASLAuthenticated(user))
         {
-            ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Failed to execute query: {}", PQerrorMessage(conn)));
-            PQclear(res);
-            return true; // Allow connections if query fails
+            ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("*** reCAPTCHA: User {} bypassed reCAPTCHA check due to successful SASL authentication.", user->nick));
+            ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("*** reCAPTCHA: User {} bypassed reCAPTCHA check due to successful SASL authentication.", user->nick));
+            state->verdict = CaptchaState::ALLOWED;
+            return MOD_RES_PASSTHRU;
         }
 
-        int count = atoi(PQgetvalue(res, 0, 0));
-        PQclear(res);
+        if (state->verdict == CaptchaState::DENIED)
+            return hold ? Hold(user, *state) : Refuse(user);
 
-        if (count > 0)
+        // A valid token settles the check without waiting on the database.
+        std::string error;
+        if (tokens.IsEnabled() && !user->password.empty() && AcceptToken(user, user->password, error))
+            return MOD_RES_PASSTHRU;
+
+        if (ServerInstance->Time() - state->started >= check_timeout)
         {
-            ip_cache[ip] = now + std::chrono::minutes(CACHE_DURATION_MINUTES); // Cache for defined duration
-            return true;
+            // Allow connections if the database is too slow to answer.
+            ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("*** reCAPTCHA: Check for {} timed out, skipping reCAPTCHA check.", user->client_sa.addr()));
+            state->verdict = CaptchaState::ALLOWED;
+            return MOD_RES_PASSTHRU;
         }
 
-        return false;
+        return MOD_RES_DENY;
     }
 
-    std::string ExtractIP(const std::string& client_sa_str)
+    // Refuses an unverified user who has finished registering, unless the
+    // connection password is a token from the web verify page.
+    ModResult Refuse(LocalUser* user)
     {
-        std::string::size_type pos = client_sa_str.find(':');
-        if (pos != std::string::npos)
-        {
-            return client_sa_str.substr(0, pos);
-        }
-        return client_sa_str;
-    }
-
-   ModResult OnUserRegister(LocalUser* user) override
-{
-    int port = user->server_sa.port();
-    std::string client_sa_str = user->client_sa.str();
-    std::string ip = ExtractIP(client_sa_str);
-
-    ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("*** reCAPTCHA: Activated for user {} ({}) on port {}", user->nick, client_sa_str, port));
+        std::string error;
+        if (tokens.IsEnabled() && !user->password.empty() && AcceptToken(user, user->password, error))
+            return MOD_RES_PASSTHRU;
 
-    // Check if SASL authentication was successful
-    SimpleExtItem<std::string>* saslExt = static_cast<SimpleExtItem<std::string>*>(
-        ServerInstance->Extensions.GetItem("sasl-state"));
-
-    if (saslExt && saslExt->Get(user))
-    {
-        ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("*** reCAPTCHA: User {} bypassed reCAPTCHA check due to successful SASL authentication.", user->nick));
-        ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("*** reCAPTCHA: User {} bypassed reCAPTCHA check due to successful SASL authentication.", user->nick));
-        return MOD_RES_PASSTHRU;
-    }
+        if (!error.empty())
+            user->WriteNotice("*** reCAPTCHA: Your token was not accepted: " + error);
 
-    if (ports.find(port) == ports.end())
-    {
-        ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("*** reCAPTCHA: Port {} is not in the Google reCAPTCHA check list.", port));
-        return MOD_RES_PASSTHRU;
-    }
+        // Only refusals after SASL count towards the reconnect throttle.
+        CaptchaCache::Value* cached = ip_cache.Find(CaptchaKey(user->client_sa), ServerInstance->Time());
+        if (cached && !cached->allowed)
+            cached->attempts++;
 
-    if (!CheckCaptcha(ip))
-    {
         user->WriteNotice("***** reCAPTCHA: You must solve a Google reCAPTCHA to connect. Please visit " + captcha_url + " and then reconnect.");
-        ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("*** reCAPTCHA: User {} denied access due to unsolved CAPTCHA (IP: {})", user->nick, ip));
+        ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("*** reCAPTCHA: User {} denied access due to unsolved CAPTCHA (IP: {})", user->nick, user->client_sa.addr()));
         ServerInstance->Users.QuitUser(user, "*** reCAPTCHA: Google reCAPTCHA was not solved. Please try again at " + captcha_url + " and then reconnect. Problems? join #help from our website. ");
         return MOD_RES_DENY;
     }
 
-    ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("*** reCAPTCHA: User {} allowed access after reCAPTCHA verification (IP: {})", user->nick, ip));
-    return MOD_RES_PASSTHRU;
-}
+    // NICK and USER have arrived, but SASL may not have finished and the
+    // check may not have either; OnCheckReady decides.
+    ModResult OnUserRegister(LocalUser* user) override
+    {
+        int port = user->server_sa.port();
+        ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("*** reCAPTCHA: Activated for user {} ({}) on port {}", user->nick, user->client_sa.str(), port));
+        if (ports.find(port) == ports.end())
+            ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("*** reCAPTCHA: Port {} is not in the Google reCAPTCHA check list.", port));
+        return MOD_RES_PASSTHRU;
+    }
 
     Command* RecaptchaCommand;
 
@@ -197,17 +2484,50 @@ public:
     private:
         ModuleCaptchaCheck* parent;
 
+        // Sends a notice to an oper who may have quit while the query ran.
+        static void Reply(const std::string& uuid, const std::string& message)
+        {
+            User* user = ServerInstance->Users.FindUUID(uuid);
+            if (user)
+                user->WriteNotice(message);
+        }
+
     public:
         CommandRecaptcha(Module* Creator, ModuleCaptchaCheck* Parent)
-            : Command(Creator, "RECAPTCHA", 2, 2), parent(Parent)
+            : Command(Creator, "RECAPTCHA", 2, 3), parent(Parent)
         {
             this->syntax.clear();
-            this->syntax.push_back("add <ip>");
-            this->syntax.push_back("search <ip>");
+            this->syntax.push_back("add <ip>[/<length>] [<duration>]");
+            this->syntax.push_back("search <ip>[/<length>]");
+            this->syntax.push_back("import <file>");
+            this->syntax.push_back("export <file>");
+            this->syntax.push_back("token <token>");
+            this->works_before_reg = true;
         }
 
         CmdResult Handle(User* user, const Params& parameters) override
         {
+            // Anyone may present a token, usually before registering.
+            if (irc::equals(parameters[0], "token"))
+            {
+                LocalUser* luser = IS_LOCAL(user);
+                if (!luser || !parent->tokens.IsEnabled())
+                {
+                    user->WriteNotice("*** reCAPTCHA: Tokens are not enabled on this server.");
+                    return CmdResult::FAILURE;
+                }
+
+                std::string error;
+                if (!parent->AcceptToken(luser, parameters[1], error))
+                {
+                    user->WriteNotice("*** reCAPTCHA: Your token was not accepted: " + error);
+                    return CmdResult::FAILURE;
+                }
+
+                user->WriteNotice("*** reCAPTCHA: Your token was accepted.");
+                return CmdResult::SUCCESS;
+            }
+
             if (!user->HasPrivPermission("users/auspex"))
             {
                 user->WriteNotice("*** reCAPTCHA: You do not have permission to use this command.");
@@ -217,76 +2537,108 @@ public:
             if (parameters[0] == "add")
             {
                 const std::string& ip = parameters[1];
-                if (ip.length() > IRC_MAX_LENGTH - 50) // Allow room for command overhead
+                CaptchaPrefix prefix;
+                if (!CaptchaPrefix::Parse(ip, prefix))
                 {
-                    user->WriteNotice("*** reCAPTCHA: IP address too long, cannot add.");
+                    user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Invalid IP address or range, cannot add: {}", ip));
                     return CmdResult::FAILURE;
                 }
 
-                PGconn* conn = parent->GetConnection();
-
-                if (!conn)
+                // Entries without a duration never expire.
+                unsigned long duration = 0;
+                if (parameters.size() > 2 && (!Duration::TryFrom(parameters[2], duration) || !duration))
                 {
-                    user->WriteNotice("*** reCAPTCHA: Database connection error.");
+                    user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Invalid duration, cannot add: {}", parameters[2]));
                     return CmdResult::FAILURE;
                 }
+                time_t expires = duration ? ServerInstance->Time() + duration : 0;
 
-                std::string query = INSP_FORMAT("INSERT INTO ircaccess_alloweduser (ip_address) VALUES ('{}')", ip);
-                PGresult* res = PQexec(conn, query.c_str());
-
-                if (PQresultStatus(res) != PGRES_COMMAND_OK)
+                if (!parent->db.IsReady())
                 {
-                    user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Failed to add IP: {}", PQerrorMessage(conn)));
-                    PQclear(res);
+                    user->WriteNotice("*** reCAPTCHA: Database connection error.");
                     return CmdResult::FAILURE;
                 }
 
-                PQclear(res);
-                user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Successfully added IP: {}", ip));
+                std::string uuid = user->uuid;
+                parent->db.Submit("captcha_add", { prefix.ToInet(), EncodeInt8(expires) }, [this, uuid, ip, prefix, expires, duration](PGresult* res)
+                {
+                    if (!res || PQresultStatus(res) != PGRES_COMMAND_OK)
+                    {
+                        Reply(uuid, INSP_FORMAT("*** reCAPTCHA: Failed to add IP: {}", res ? PQresultErrorMessage(res) : "database unavailable"));
+                        return;
+                    }
+
+                    if (!strcmp(PQcmdTuples(res), "0"))
+                    {
+                        Reply(uuid, INSP_FORMAT("*** reCAPTCHA: Failed to add IP: {} (the table needs an expires_at column for a duration)", ip));
+                        return;
+                    }
+
+                    parent->allowlist.Add(prefix, expires);
+                    parent->ForgetVerdicts(prefix);
+                    if (duration)
+                        Reply(uuid, INSP_FORMAT("*** reCAPTCHA: Successfully added IP: {} (expires in {})", ip, Duration::ToString(duration)));
+                    else
+                        Reply(uuid, INSP_FORMAT("*** reCAPTCHA: Successfully added IP: {}", ip));
+                });
                 return CmdResult::SUCCESS;
             }
             else if (parameters[0] == "search")
             {
                 const std::string& ip = parameters[1];
-                if (ip.length() > IRC_MAX_LENGTH - 50) // Allow room for command overhead
+                CaptchaPrefix prefix;
+                if (!CaptchaPrefix::Parse(ip, prefix))
                 {
-                    user->WriteNotice("*** reCAPTCHA: IP address too long, cannot search.");
+                    user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Invalid IP address or range, cannot search: {}", ip));
                     return CmdResult::FAILURE;
                 }
 
-                PGconn* conn = parent->GetConnection();
-
-                if (!conn)
+                if (!parent->db.IsReady())
                 {
                     user->WriteNotice("*** reCAPTCHA: Database connection error.");
                     return CmdResult::FAILURE;
                 }
 
-                std::string query = INSP_FORMAT("SELECT ip_address FROM ircaccess_alloweduser WHERE ip_address = '{}'", ip);
-                PGresult* res = PQexec(conn, query.c_str());
-
-                if (PQresultStatus(res) != PGRES_TUPLES_OK)
+                std::string uuid = user->uuid;
+                parent->db.Submit("captcha_search", { prefix.ToInet() }, [uuid, ip](PGresult* res)
                 {
-                    user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Failed to search for IP: {}", PQerrorMessage(conn)));
-                    PQclear(res);
-                    return CmdResult::FAILURE;
-                }
+                    if (!res || PQresultStatus(res) != PGRES_TUPLES_OK)
+                    {
+                        Reply(uuid, INSP_FORMAT("*** reCAPTCHA: Failed to search for IP: {}", res ? PQresultErrorMessage(res) : "database unavailable"));
+                        return;
+                    }
 
-                if (PQntuples(res) > 0)
-                {
-                    user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: IP found: {}", ip));
-                }
-                else
+                    if (PQntuples(res) > 0)
+                    {
+                        for (int row = 0; row < PQntuples(res); ++row)
+                        {
+                            if (PQgetisnull(res, row, 1))
+                                Reply(uuid, INSP_FORMAT("*** reCAPTCHA: IP found: {} (entry {})", ip, PQgetvalue(res, row, 0)));
+                            else
+                                Reply(uuid, INSP_FORMAT("*** reCAPTCHA: IP found: {} (entry {}, expires {})", ip, PQgetvalue(res, row, 0), PQgetvalue(res, row, 1)));
+                        }
+                    }
+                    else
+                    {
+                        Reply(uuid, INSP_FORMAT("*** reCAPTCHA: IP not found: {}", ip));
+                    }
+                });
+                return CmdResult::SUCCESS;
+            }
+            else if (parameters[0] == "import" || parameters[0] == "export")
+            {
+                // Reading and writing files on the server needs more than auspex.
+                if (!user->HasPrivPermission("servers/recaptcha-copy"))
                 {
-                    user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: IP not found: {}", ip));
+                    user->WriteNotice("*** reCAPTCHA: You need the servers/recaptcha-copy privilege to import or export.");
+                    return CmdResult::FAILURE;
                 }
 
-                PQclear(res);
-                return CmdResult::SUCCESS;
+                return parent->StartCopy(user, parameters[0] == "import", parameters[1]) ? CmdResult::SUCCESS : CmdResult::FAILURE;
             }
             else
             {
-                user->WriteNotice("*** reCAPTCHA: Unknown subcommand. Use add <ip> or search <ip>. Example: /reCAPTCHA add 127.0.0.1");
+                user->WriteNotice("*** reCAPTCHA: Unknown subcommand. Use add <ip> [<duration>], search <ip>, import <file> or export <file>. Example: /reCAPTCHA add 127.0.0.1");
                 return CmdResult::FAILURE;
             }
         }
@@ -296,10 +2648,13 @@ public:
     {
         RecaptchaCommand = new CommandRecaptcha(this, this);
         ServerInstance->Modules.AddService(*RecaptchaCommand);
+        ServerInstance->Timers.AddTimer(&timer);
     }
 
     ~ModuleCaptchaCheck() override
     {
+        db.Shutdown();
+        delete copy_job;
         delete RecaptchaCommand;
     }
 };
@@ -18,7 +18,8 @@
 
 /// $ModAuthor: reverse <mike.chevronnet@gmail.com>
 /// $ModDesc: Adds city and country information to WHOIS using the MaxMind database.
-/// $ModConfig: <geolite dbpath="path/geodata/GeoLite2-City.mmdb">
+/// $ModConfig: <geolite dbpath="path/geodata/GeoLite2-City.mmdb" languages="en fr es">
+/// $ModConfig: <oper geolanguage="fr">
 /// $ModDepends: core 4
 
 /// $LinkerFlags: -lmaxminddb
@@ -27,6 +28,95 @@
 #include "modules/whois.h"
 #include "extension.h"
 #include <maxminddb.h>
+#include <algorithm>
+
+// City and country names of every location seen so far, resolved once per
+// database record in each configured language. Language 0 is the server
+// language. Locations are interned by GeoNames id and country code so their
+// ids stay valid when the database is reloaded.
+class LocationTable final
+{
+private:
+	std::vector<std::string> languages;
+	std::vector<std::string> cities;    // cities[id * languages + language]
+	std::vector<std::string> countries; // countries[id * languages + language]
+	std::unordered_map<std::string, uint32_t> ids;
+	std::unordered_map<uint32_t, uint32_t> offsets; // Record offset to id for the open database
+
+	static std::string GetString(MMDB_entry_s& entry, const char* field, const char* key, const std::string& language)
+	{
+		const char* const path[] = { field, key, language.c_str(), nullptr };
+		MMDB_entry_data_s data = {};
+		if (MMDB_aget_value(&entry, &data, path) != MMDB_SUCCESS || !data.has_data || data.type != MMDB_DATA_TYPE_UTF8_STRING)
+			return "";
+		return std::string(data.utf8_string, data.data_size);
+	}
+
+	const std::string& Get(const std::vector<std::string>& names, uint32_t id, size_t lang) const
+	{
+		const std::string& name = names[id * languages.size() + lang];
+		return name.empty() ? names[id * languages.size()] : name;
+	}
+
+public:
+	// Forgets the record offsets of the previous database, and every location
+	// if the languages changed. Returns true if location ids were invalidated.
+	bool Reset(const std::vector<std::string>& newlanguages)
+	{
+		offsets.clear();
+		if (newlanguages == languages)
+			return false;
+
+		languages = newlanguages;
+		cities.clear();
+		countries.clear();
+		ids.clear();
+		return true;
+	}
+
+	size_t LanguageIndex(const std::string& language) const
+	{
+		auto it = std::find(languages.begin(), languages.end(), language);
+		return it == languages.end() ? 0 : it - languages.begin();
+	}
+
+	uint32_t Intern(MMDB_entry_s entry)
+	{
+		auto oit = offsets.find(entry.offset);
+		if (oit != offsets.end())
+			return oit->second;
+
+		MMDB_entry_data_s geoname_data = {};
+		MMDB_entry_data_s code_data = {};
+		int status_geoname = MMDB_get_value(&entry, &geoname_data, "city", "geoname_id", nullptr);
+		int status_code = MMDB_get_value(&entry, &code_data, "country", "iso_code", nullptr);
+
+		std::string key = (status_geoname == MMDB_SUCCESS && geoname_data.has_data) ? ConvToStr(geoname_data.uint32) : "";
+		key.push_back(':');
+		if (status_code == MMDB_SUCCESS && code_data.has_data)
+			key.append(code_data.utf8_string, code_data.data_size);
+
+		auto it = ids.find(key);
+		if (it == ids.end()) {
+			uint32_t id = static_cast<uint32_t>(ids.size());
+			for (const auto& language : languages) {
+				cities.push_back(GetString(entry, "city", "names", language));
+				countries.push_back(GetString(entry, "country", "names", language));
+			}
+			it = ids.emplace(key, id).first;
+		}
+
+		offsets.emplace(entry.offset, it->second);
+		return it->second;
+	}
+
+	std::string Describe(uint32_t id, size_t lang) const
+	{
+		const std::string& city = Get(cities, id, lang);
+		const std::string& country = Get(countries, id, lang);
+		return "City: " + (city.empty() ? "Unknown" : city) + ", Country: " + (country.empty() ? "Unknown" : country);
+	}
+};
 
 class ModuleWhoisGeoLite final : public Module, public Whois::EventListener
 {
@@ -34,12 +124,15 @@ private:
 	MMDB_s mmdb;                 // MaxMind database object
 	std::string dbpath;          // Path to the GeoLite2 database
 	StringExtItem country_item;  // Extension item for storing city and country info
+	IntExtItem location_item;    // Location id + 1 of the user (local only)
+	LocationTable locations;     // Interned city and country names
 
 public:
 	ModuleWhoisGeoLite()
 		: Module(VF_OPTCOMMON, "Adds city and country information to WHOIS using the MaxMind database.")
 		, Whois::EventListener(this)
 		, country_item(this, "geo-lite-country", ExtensionType::USER, true) // Sync
+		, location_item(this, "geo-lite-location", ExtensionType::USER)
 	{
 	}
 
@@ -48,11 +141,27 @@ public:
 		auto& tag = ServerInstance->Config->ConfValue("geolite");
 		dbpath = ServerInstance->Config->Paths.PrependConfig(tag->getString("dbpath", "data/GeoLite2-City.mmdb"));
 
+		std::vector<std::string> languages;
+		irc::spacesepstream langstream(tag->getString("languages", "en"));
+		std::string language;
+		while (langstream.GetToken(language)) {
+			if (std::find(languages.begin(), languages.end(), language) == languages.end())
+				languages.push_back(language);
+		}
+		if (languages.empty())
+			languages.push_back("en");
+
 		int status_open = MMDB_open(dbpath.c_str(), MMDB_MODE_MMAP, &mmdb);
 		if (status_open != MMDB_SUCCESS) {
 			std::string error_msg = "GeoLite2: Failed to open GeoLite2 database: " + std::string(MMDB_strerror(status_open));
 			throw ModuleException(this, error_msg.c_str());
 		}
+
+		// Users fall back to the synced text until they reconnect.
+		if (locations.Reset(languages)) {
+			for (LocalUser* user : ServerInstance->Users.GetLocalUsers())
+				location_item.Unset(user);
+		}
 	}
 
 	void OnWhois(Whois::Context& whois) override
@@ -63,6 +172,14 @@ public:
 		if (!source->IsOper())
 			return;
 
+		// Local users are shown in the oper's language when they have one.
+		intptr_t location = location_item.Get(target);
+		if (location) {
+			size_t lang = locations.LanguageIndex(source->oper->GetConfig()->getString("geolanguage"));
+			whois.SendLine(RPL_WHOISSPECIAL, "is connecting from " + locations.Describe(static_cast<uint32_t>(location - 1), lang));
+			return;
+		}
+
 		const std::string* info = country_item.Get(target);
 		if (info && !info->empty()) {
 			whois.SendLine(RPL_WHOISSPECIAL, "is connecting from " + *info);
@@ -75,6 +192,7 @@ public:
 	{
 		if (!user->client_sa.is_ip()) {
 			country_item.Unset(user);
+			location_item.Unset(user);
 			return;
 		}
 
@@ -84,18 +202,14 @@ public:
 
 		if (gai_error != 0 || !result.found_entry) {
 			country_item.Unset(user);
+			location_item.Unset(user);
 			return;
 		}
 
-		MMDB_entry_data_s city_data = {};
-		MMDB_entry_data_s country_data = {};
-		int status_city = MMDB_get_value(&result.entry, &city_data, "city", "names", "en", nullptr);
-		int status_country = MMDB_get_value(&result.entry, &country_data, "country", "names", "en", nullptr);
-
-		std::string city = (status_city == MMDB_SUCCESS && city_data.has_data) ? std::string(city_data.utf8_string, city_data.data_size) : "Unknown";
-		std::string country = (status_country == MMDB_SUCCESS && country_data.has_data) ? std::string(country_data.utf8_string, country_data.data_size) : "Unknown";
-
-		country_item.Set(user, "City: " + city + ", Country: " + country);
+		// Other servers get the text in the server language.
+		uint32_t location = locations.Intern(result.entry);
+		location_item.Set(user, location + 1);
+		country_item.Set(user, locations.Describe(location, 0));
 	}
 
 	~ModuleWhoisGeoLite() override
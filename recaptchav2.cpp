@@ -8,40 +8,702 @@
  * redistribute it and/or modify it under the terms of the GNU General Public
  * License as published by the Free Software Foundation; version 2.
  */
-​
+
 /// $ModAuthor: reverse mike.chevronnet@gmail.com
-/// $ModConfig: <captchaconfig conninfo="dbname=example user=postgres password=secret hostaddr=127.0.0.1 port=5432" mode="master/slave" masterserver="master.example.com" url="http://meme.com/verify/" whitelistchan="#help,#support" whitelistport="6697,6666">
+/// $ModConfig: <captchaconfig conninfo="dbname=example user=postgres password=secret hostaddr=127.0.0.1 port=5432" mode="master/slave" masterserver="master1.example.com,master2.example.com" checktimeout="5s" url="http://meme.com/verify/" whitelistchan="#help,#support" whitelistport="6697,6666" cachesize="65536" cacheduration="10m" syncinterval="1m" replication="full" bloomfprate="0.01" bloommaxsize="1048576">
 /// $ModDepends: core 4
-​
+
 /// $CompilerFlags: find_compiler_flags("libpq")
 /// $LinkerFlags: find_linker_flags("libpq")
-​
+
 #include "inspircd.h"
 #include "extension.h"
 #include "modules/account.h"
+#include "modules/server.h"
 #include "protocol.h"
 #include <libpq-fe.h>
+#include <poll.h>
 #include <unordered_map>
 #include <unordered_set>
 #include <set>
-#include <chrono>
-​
-class ModuleCaptchaCheck : public Module
+#include <algorithm>
+#include <functional>
+#include <cmath>
+
+// An address as two 64-bit words, with IPv4 addresses mapped into IPv6.
+struct CaptchaKey
+{
+    uint64_t hi = 0;
+    uint64_t lo = 0;
+
+    CaptchaKey(const irc::sockets::sockaddrs& sa)
+    {
+        unsigned char bytes[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+        if (sa.family() == AF_INET6)
+            memcpy(bytes, &sa.in6.sin6_addr, 16);
+        else
+            memcpy(bytes + 12, &sa.in4.sin_addr, 4);
+        memcpy(&hi, bytes, 8);
+        memcpy(&lo, bytes + 8, 8);
+    }
+
+    CaptchaKey(const unsigned char* bytes)
+    {
+        memcpy(&hi, bytes, 8);
+        memcpy(&lo, bytes + 8, 8);
+    }
+
+    void GetBytes(unsigned char* bytes) const
+    {
+        memcpy(bytes, &hi, 8);
+        memcpy(bytes + 8, &lo, 8);
+    }
+
+    bool IsIPv4() const
+    {
+        static const unsigned char prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+        unsigned char bytes[16];
+        GetBytes(bytes);
+        return !memcmp(bytes, prefix, sizeof(prefix));
+    }
+
+    // The address in the usual text form, as an IPv4 address if it is one.
+    std::string ToString() const
+    {
+        unsigned char bytes[16];
+        GetBytes(bytes);
+        char buffer[INET6_ADDRSTRLEN];
+        if (IsIPv4())
+            inet_ntop(AF_INET, bytes + 12, buffer, sizeof(buffer));
+        else
+            inet_ntop(AF_INET6, bytes, buffer, sizeof(buffer));
+        return buffer;
+    }
+
+    bool operator==(const CaptchaKey& other) const
+    {
+        return hi == other.hi && lo == other.lo;
+    }
+};
+
+struct CaptchaKeyHash
+{
+    size_t operator()(const CaptchaKey& key) const
+    {
+        return std::hash<uint64_t>()((key.hi * 0x9E3779B97F4A7C15ULL) ^ key.lo);
+    }
+};
+
+// A Bloom filter of allowed addresses. Bit positions are derived from the
+// address bytes alone, so every server computes the same ones.
+class CaptchaBloomFilter
+{
+private:
+    std::string data;
+    uint64_t bits = 0;
+    unsigned int hashes = 0;
+
+    static uint64_t Mix(uint64_t x)
+    {
+        x ^= x >> 30;
+        x *= 0xBF58476D1CE4E5B9ULL;
+        x ^= x >> 27;
+        x *= 0x94D049BB133111EBULL;
+        x ^= x >> 31;
+        return x;
+    }
+
+    // Double hashing: position i is h1 + i * h2.
+    void Hash(const CaptchaKey& key, uint64_t& h1, uint64_t& h2) const
+    {
+        unsigned char bytes[16];
+        key.GetBytes(bytes);
+        uint64_t hi = 0;
+        uint64_t lo = 0;
+        for (size_t i = 0; i < 8; ++i)
+        {
+            hi = (hi << 8) | bytes[i];
+            lo = (lo << 8) | bytes[i + 8];
+        }
+        h1 = Mix(hi ^ Mix(lo));
+        h2 = Mix(h1 ^ lo) | 1;
+    }
+
+public:
+    // Works out the size of a filter for the given number of entries and
+    // false positive rate, capped at maxbytes.
+    static void Size(size_t entries, double fprate, size_t maxbytes, uint64_t& nbits, unsigned int& nhashes)
+    {
+        const double ln2 = std::log(2.0);
+        double n = static_cast<double>(std::max<size_t>(entries, 1));
+        double m = std::ceil(-n * std::log(fprate) / (ln2 * ln2));
+        nbits = std::max<uint64_t>(1024, std::min<uint64_t>(static_cast<uint64_t>(m), static_cast<uint64_t>(maxbytes) * 8));
+        nbits = (nbits + 7) & ~static_cast<uint64_t>(7);
+        nhashes = static_cast<unsigned int>(std::lround(nbits / n * ln2));
+        nhashes = std::clamp(nhashes, 1U, 16U);
+    }
+
+    void Reset(uint64_t nbits, unsigned int nhashes)
+    {
+        bits = nbits;
+        hashes = nhashes;
+        data.assign(nbits / 8, '\0');
+    }
+
+    // Takes over a filter received from the master.
+    bool Load(uint64_t nbits, unsigned int nhashes, std::string&& bytes)
+    {
+        if (!nbits || nbits % 8 || !nhashes || nhashes > 16 || bytes.size() != nbits / 8)
+            return false;
+
+        bits = nbits;
+        hashes = nhashes;
+        data = std::move(bytes);
+        return true;
+    }
+
+    uint64_t Bits() const { return bits; }
+    unsigned int Hashes() const { return hashes; }
+    const std::string& Data() const { return data; }
+
+    void Add(const CaptchaKey& key)
+    {
+        uint64_t h1;
+        uint64_t h2;
+        Hash(key, h1, h2);
+        for (unsigned int i = 0; i < hashes; ++i)
+        {
+            uint64_t bit = (h1 + i * h2) % bits;
+            data[bit / 8] |= static_cast<char>(1 << (bit % 8));
+        }
+    }
+
+    // The expected false positive rate once the given number of addresses
+    // have been added.
+    double FalsePositiveRate(size_t entries) const
+    {
+        if (!bits)
+            return 1;
+        return std::pow(1 - std::exp(-static_cast<double>(hashes) * entries / bits), hashes);
+    }
+
+    bool MayContain(const CaptchaKey& key) const
+    {
+        uint64_t h1;
+        uint64_t h2;
+        Hash(key, h1, h2);
+        for (unsigned int i = 0; i < hashes; ++i)
+        {
+            uint64_t bit = (h1 + i * h2) % bits;
+            if (!(data[bit / 8] & (1 << (bit % 8))))
+                return false;
+        }
+        return true;
+    }
+};
+
+// The allowlist as published by the master, as a set of addresses or as a
+// Bloom filter of them, which can only rule addresses out. Changes
+// are numbered within an epoch, the time the master first loaded it, so a
+// server which misses one can tell and ask for a fresh snapshot.
+//
+// On the wire the addresses are packed as a family byte (4 or 6) followed by
+// the address bytes, in base64 chunks small enough for one ENCAP line. A
+// filter is sent as its raw bytes in the same size of chunk.
+class CaptchaReplica
+{
+public:
+    typedef std::unordered_set<CaptchaKey, CaptchaKeyHash> KeySet;
+    static constexpr size_t CHUNK_BYTES = 270;
+
+private:
+    KeySet keys;
+    KeySet staging;
+    CaptchaBloomFilter filter;
+    std::string staging_filter;
+    uint64_t staging_bits = 0;
+    unsigned int staging_hashes = 0;
+    time_t epoch = 0;
+    uint64_t serial = 0;
+    time_t staging_epoch = 0;
+    uint64_t staging_serial = 0;
+    bool loaded = false;
+    bool receiving = false;
+    bool filtered = false;          // Whether the replica is a filter
+    bool staging_filtered = false;
+
+public:
+    template<typename Keys>
+    static void Pack(const Keys& keys, std::vector<std::string>& chunks)
+    {
+        std::string chunk;
+        for (const auto& key : keys)
+        {
+            unsigned char bytes[16];
+            key.GetBytes(bytes);
+            if (key.IsIPv4())
+            {
+                chunk.push_back(4);
+                chunk.append(reinterpret_cast<const char*>(bytes + 12), 4);
+            }
+            else
+            {
+                chunk.push_back(6);
+                chunk.append(reinterpret_cast<const char*>(bytes), 16);
+            }
+
+            if (chunk.size() + 17 > CHUNK_BYTES)
+            {
+                chunks.push_back(Base64::Encode(chunk));
+                chunk.clear();
+            }
+        }
+
+        if (!chunk.empty())
+            chunks.push_back(Base64::Encode(chunk));
+    }
+
+    static bool Unpack(const std::string& data, std::vector<CaptchaKey>& keys)
+    {
+        std::string chunk = Base64::Decode(data);
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(chunk.data());
+        for (size_t pos = 0; pos < chunk.size(); )
+        {
+            unsigned char address[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+            if (bytes[pos] == 4 && pos + 5 <= chunk.size())
+            {
+                memcpy(address + 12, bytes + pos + 1, 4);
+                pos += 5;
+            }
+            else if (bytes[pos] == 6 && pos + 17 <= chunk.size())
+            {
+                memcpy(address, bytes + pos + 1, 16);
+                pos += 17;
+            }
+            else
+            {
+                return false;
+            }
+            keys.emplace_back(address);
+        }
+        return true;
+    }
+
+    bool IsLoaded() const { return loaded; }
+    bool IsFiltered() const { return filtered; }
+    bool IsReceivingFilter() const { return receiving && staging_filtered; }
+    size_t Size() const { return keys.size(); }
+    time_t Epoch() const { return epoch; }
+    uint64_t Serial() const { return serial; }
+    const KeySet& Keys() const { return keys; }
+
+    // Whether an address is known to be allowed. Never true for a filter.
+    bool Contains(const CaptchaKey& key) const
+    {
+        return !filtered && keys.count(key);
+    }
+
+    // Whether an address may be allowed. False is definite either way.
+    bool MayContain(const CaptchaKey& key) const
+    {
+        return filtered ? filter.MayContain(key) : keys.count(key);
+    }
+
+    void Replace(KeySet&& newkeys, time_t newepoch, uint64_t newserial)
+    {
+        keys = std::move(newkeys);
+        filter = CaptchaBloomFilter();
+        epoch = newepoch;
+        serial = newserial;
+        loaded = true;
+        receiving = false;
+        filtered = false;
+    }
+
+    // Numbers the next change made by the master.
+    uint64_t NextSerial()
+    {
+        return ++serial;
+    }
+
+    bool Add(const CaptchaKey& key)
+    {
+        if (!filtered)
+            return keys.insert(key).second;
+
+        filter.Add(key);
+        return true;
+    }
+
+    // Removals from a filter wait for the master to send a new one.
+    bool Remove(const CaptchaKey& key)
+    {
+        return !filtered && keys.erase(key);
+    }
+
+    // Whether a change from the master is the next one expected, in which
+    // case it is counted as applied.
+    bool Follows(time_t changeepoch, uint64_t changeserial)
+    {
+        if (!loaded || changeepoch != epoch || changeserial != serial + 1)
+            return false;
+
+        serial = changeserial;
+        return true;
+    }
+
+    void BeginSnapshot(time_t newepoch, uint64_t newserial)
+    {
+        staging.clear();
+        staging_epoch = newepoch;
+        staging_serial = newserial;
+        receiving = true;
+        staging_filtered = false;
+    }
+
+    void BeginFilter(time_t newepoch, uint64_t newserial, uint64_t nbits, unsigned int nhashes)
+    {
+        BeginSnapshot(newepoch, newserial);
+        staging_filter.clear();
+        staging_bits = nbits;
+        staging_hashes = nhashes;
+        staging_filtered = true;
+    }
+
+    bool StageFilter(time_t newepoch, uint64_t newserial, const std::string& chunk)
+    {
+        if (!IsReceivingFilter() || newepoch != staging_epoch || newserial != staging_serial)
+            return false;
+
+        staging_filter.append(chunk);
+        return true;
+    }
+
+    bool Stage(time_t newepoch, uint64_t newserial, const std::vector<CaptchaKey>& chunk)
+    {
+        if (!receiving || staging_filtered || newepoch != staging_epoch || newserial != staging_serial)
+            return false;
+
+        staging.insert(chunk.begin(), chunk.end());
+        return true;
+    }
+
+    bool EndSnapshot(time_t newepoch, uint64_t newserial)
+    {
+        if (!receiving || newepoch != staging_epoch || newserial != staging_serial)
+            return false;
+
+        receiving = false;
+        if (!staging_filtered)
+        {
+            Replace(std::move(staging), newepoch, newserial);
+            staging = KeySet();
+            return true;
+        }
+
+        if (!filter.Load(staging_bits, staging_hashes, std::move(staging_filter)))
+            return false;
+
+        staging_filter = std::string();
+        keys = KeySet();
+        epoch = newepoch;
+        serial = newserial;
+        loaded = true;
+        filtered = true;
+        return true;
+    }
+};
+
+// A fixed-capacity cache of verified addresses. Entries expire through a
+// timer wheel with one slot per second, and the least recently used entry
+// is evicted when the cache is full. A check is a single hash probe.
+class CaptchaCache
 {
 private:
+    static constexpr uint32_t NONE = UINT32_MAX;
+    static constexpr size_t WHEEL_SLOTS = 256;
+
+    struct Link
+    {
+        uint32_t prev = NONE;
+        uint32_t next = NONE;
+    };
+
+    struct Entry
+    {
+        CaptchaKey key;
+        time_t expires;
+        Link lru;
+        Link wheel;
+    };
+
+    std::vector<Entry> entries;
+    std::vector<uint32_t> free_entries;
+    std::unordered_map<CaptchaKey, uint32_t, CaptchaKeyHash> index;
+    std::vector<uint32_t> wheel = std::vector<uint32_t>(WHEEL_SLOTS, NONE);
+    uint32_t lru_head = NONE; // Most recently used
+    uint32_t lru_tail = NONE; // Least recently used
+    size_t capacity = 0;
+    time_t last_expire = 0;
+
+    void Unlink(uint32_t id, Link Entry::*member, uint32_t& head, uint32_t* tail)
+    {
+        Link& link = entries[id].*member;
+        if (link.prev != NONE)
+            (entries[link.prev].*member).next = link.next;
+        else
+            head = link.next;
+
+        if (link.next != NONE)
+            (entries[link.next].*member).prev = link.prev;
+        else if (tail)
+            *tail = link.prev;
+
+        link = Link();
+    }
+
+    void PushFront(uint32_t id, Link Entry::*member, uint32_t& head, uint32_t* tail)
+    {
+        Link& link = entries[id].*member;
+        link.prev = NONE;
+        link.next = head;
+        if (head != NONE)
+            (entries[head].*member).prev = id;
+        else if (tail)
+            *tail = id;
+        head = id;
+    }
+
+    uint32_t& Slot(time_t expires)
+    {
+        return wheel[static_cast<size_t>(expires) % WHEEL_SLOTS];
+    }
+
+    void Remove(uint32_t id)
+    {
+        Entry& entry = entries[id];
+        Unlink(id, &Entry::lru, lru_head, &lru_tail);
+        Unlink(id, &Entry::wheel, Slot(entry.expires), nullptr);
+        index.erase(entry.key);
+        free_entries.push_back(id);
+    }
+
+public:
+    // Empties the cache and sets how many addresses it may hold. A capacity
+    // of zero disables it.
+    void Reset(size_t newcapacity)
+    {
+        entries.clear();
+        free_entries.clear();
+        index.clear();
+        std::fill(wheel.begin(), wheel.end(), NONE);
+        lru_head = lru_tail = NONE;
+        capacity = newcapacity;
+        entries.reserve(capacity);
+        index.reserve(capacity);
+    }
+
+    size_t Size() const
+    {
+        return index.size();
+    }
+
+    bool Find(const CaptchaKey& key, time_t now)
+    {
+        auto it = index.find(key);
+        if (it == index.end())
+            return false;
+
+        uint32_t id = it->second;
+        if (entries[id].expires <= now)
+        {
+            Remove(id);
+            return false;
+        }
+
+        Unlink(id, &Entry::lru, lru_head, &lru_tail);
+        PushFront(id, &Entry::lru, lru_head, &lru_tail);
+        return true;
+    }
+
+    void Insert(const CaptchaKey& key, time_t expires)
+    {
+        if (!capacity)
+            return;
+
+        auto [it, inserted] = index.try_emplace(key, NONE);
+        uint32_t id = it->second;
+        if (inserted)
+        {
+            if (index.size() > capacity)
+                Remove(lru_tail);
+
+            if (free_entries.empty())
+            {
+                id = static_cast<uint32_t>(entries.size());
+                entries.push_back({ key, expires, Link(), Link() });
+            }
+            else
+            {
+                id = free_entries.back();
+                free_entries.pop_back();
+                entries[id] = { key, expires, Link(), Link() };
+            }
+            it->second = id;
+        }
+        else
+        {
+            Unlink(id, &Entry::lru, lru_head, &lru_tail);
+            Unlink(id, &Entry::wheel, Slot(entries[id].expires), nullptr);
+            entries[id].expires = expires;
+        }
+
+        PushFront(id, &Entry::lru, lru_head, &lru_tail);
+        PushFront(id, &Entry::wheel, Slot(expires), nullptr);
+    }
+
+    void Erase(const CaptchaKey& key)
+    {
+        auto it = index.find(key);
+        if (it != index.end())
+            Remove(it->second);
+    }
+
+    // Removes every address for which drop returns true.
+    template<typename Predicate>
+    void EraseIf(Predicate drop)
+    {
+        std::vector<uint32_t> ids;
+        for (const auto& [key, id] : index)
+        {
+            if (drop(key))
+                ids.push_back(id);
+        }
+        for (uint32_t id : ids)
+            Remove(id);
+    }
+
+    // Drops the entries that expired since the last call. Entries in a slot
+    // which expire on a later turn of the wheel are left in place.
+    void Expire(time_t now)
+    {
+        if (!last_expire || now - last_expire > static_cast<time_t>(WHEEL_SLOTS))
+            last_expire = now - WHEEL_SLOTS;
+
+        for (time_t second = last_expire + 1; second <= now; ++second)
+        {
+            uint32_t id = Slot(second);
+            while (id != NONE)
+            {
+                uint32_t next = entries[id].wheel.next;
+                if (entries[id].expires <= now)
+                    Remove(id);
+                id = next;
+            }
+        }
+        last_expire = now;
+    }
+};
+
+// Expires cached verdicts.
+class CaptchaTimer : public Timer
+{
+private:
+    std::function<void()> callback;
+
+public:
+    CaptchaTimer(std::function<void()> cb)
+        : Timer(1, true), callback(std::move(cb))
+    {
+    }
+
+    bool Tick() override
+    {
+        callback();
+        return true;
+    }
+};
+
+// A check of an address that the master has not answered yet, with the local
+// users waiting on it. Joins from any of them while it is in flight attach
+// to it rather than asking again.
+struct CaptchaPendingCheck
+{
+    std::vector<std::string> uuids;
+    std::string ip;
+    std::string master;    // The master asked, or empty if waiting for the whitelist
+    long long sent_ms = 0; // When it was asked
+};
+
+// A master server slaves may ask, with its smoothed reply time and counters.
+struct CaptchaMaster
+{
+    std::string name;
+    bool reachable = false;
+    double rtt = 0;             // Milliseconds, 0 until measured
+    time_t suspended_until = 0; // Not preferred until then after a timeout
+    unsigned long sent = 0;
+    unsigned long answered = 0;
+    unsigned long errors = 0;   // Checks its database could not answer
+    unsigned long timeouts = 0;
+};
+
+// A channel join held back until the master answers for the user's address.
+struct CaptchaPendingJoin
+{
+    std::string channel;
+    std::string key;
+};
+
+class ModuleCaptchaCheck : public Module, public ServerProtocol::LinkEventListener
+{
+private:
+    // Where the master's background reload of the whitelist is.
+    enum class RefreshState
+    {
+        IDLE,
+        CONNECTING,
+        QUERYING
+    };
+
     std::string mode; // "master" or "slave"
     std::string conninfo;
     std::string captcha_url;
-    std::string masterserver;
+    std::vector<CaptchaMaster> masters;
+    time_t check_timeout;
     std::unordered_set<std::string> whitelist_channels;
     std::set<int> whitelist_ports;
     PGconn* db;
-    std::unordered_map<std::string, std::chrono::steady_clock::time_point> ip_cache;
+    CaptchaCache ip_cache;
+    CaptchaTimer timer;
+    time_t cache_duration;
+    size_t cache_size = 0;
     StringExtItem captcha_success;
+    SimpleExtItem<std::vector<CaptchaPendingJoin>> pending_joins;
+    std::unordered_map<CaptchaKey, CaptchaPendingCheck, CaptchaKeyHash> waiting; // Checks awaiting the master, by address
     Account::API account_api;
-​
-    static constexpr int CACHE_DURATION_MINUTES = 10;
-​
+    CaptchaReplica allowlist;
+    time_t sync_interval;
+    time_t last_sync = 0;
+    PGconn* refresh_db = nullptr;    // The master's connection for reloading the whitelist
+    RefreshState refresh_state = RefreshState::IDLE;
+    bool refresh_write = false;      // Whether connecting waits to write rather than read
+    time_t last_request = 0;
+    bool bloom = false;              // Whether the master publishes a filter instead of the whitelist
+    double bloom_fprate = 0;
+    size_t bloom_maxsize = 0;
+    CaptchaBloomFilter published;    // The filter the master last built
+    size_t published_entries = 0;    // Addresses added to it, including since-removed ones
+    double published_fprate = 0;     // Its false positive rate when it was built
+
+    static constexpr size_t MAX_PENDING_JOINS = 10;
+    static constexpr size_t MAX_DELTA = 1000; // Changes beyond this are sent as a snapshot
+    static constexpr time_t SNAPSHOT_RETRY = 30;
+    static constexpr time_t MASTER_SUSPEND = 30;
+    static constexpr double RTT_WEIGHT = 0.2; // Weight of a new sample in the smoothed reply time
+    static constexpr double BLOOM_MAX_STALE = 0.1;  // Share of removed addresses a filter may keep
+    static constexpr double BLOOM_MAX_DECAY = 2.0;  // Growth in false positive rate before a rebuild
+
     PGconn* GetConnection()
     {
         if (!db || PQstatus(db) != CONNECTION_OK)
@@ -54,7 +716,7 @@ private:
         }
         return db;
     }
-​
+
     void SyncMetadata(User* user)
     {
         const std::string* status = captcha_success.Get(user);
@@ -63,61 +725,839 @@ private:
             ServerInstance->PI->SendMetadata(user, "captcha-success", "passed");
         }
     }
-​
+
+    // Runs a query about one address, which may have come from another
+    // server or an oper, so it is checked and passed as a parameter.
+    PGresult* ExecAddress(const char* query, const std::string& ip, std::string& error)
+    {
+        irc::sockets::sockaddrs sa;
+        if (!sa.from_ip(ip))
+        {
+            error = "not a valid IP address";
+            return nullptr;
+        }
+
+        PGconn* conn;
+        try
+        {
+            conn = GetConnection();
+        }
+        catch (const ModuleException& ex)
+        {
+            error = ex.GetReason();
+            return nullptr;
+        }
+
+        const std::string address = sa.addr();
+        const char* values[] = { address.c_str() };
+        PGresult* res = PQexecParams(conn, query, 1, nullptr, values, nullptr, nullptr, 0);
+        if (!res)
+            error = PQerrorMessage(conn);
+        return res;
+    }
+
+    // Looks an address up in the database. Returns false if the query failed.
+    bool QueryAllowed(const std::string& ip, bool& allowed, std::string& error)
+    {
+        PGresult* res = ExecAddress("SELECT COUNT(*) FROM ircaccess_alloweduser WHERE ip_address = $1::inet", ip, error);
+        if (!res)
+            return false;
+
+        bool ok = PQresultStatus(res) == PGRES_TUPLES_OK;
+        if (ok)
+            allowed = atoi(PQgetvalue(res, 0, 0)) > 0;
+        else
+            error = PQresultErrorMessage(res);
+
+        PQclear(res);
+        return ok;
+    }
+
+    bool InsertAllowed(const std::string& ip, std::string& error)
+    {
+        PGresult* res = ExecAddress("INSERT INTO ircaccess_alloweduser (ip_address) VALUES ($1::inet)", ip, error);
+        if (!res)
+            return false;
+
+        bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        if (!ok)
+            error = PQresultErrorMessage(res);
+
+        PQclear(res);
+        return ok;
+    }
+
+    // Drops the reload connection, abandoning any reload in progress.
+    void StopRefresh()
+    {
+        if (refresh_db)
+            PQfinish(refresh_db);
+        refresh_db = nullptr;
+        refresh_state = RefreshState::IDLE;
+    }
+
+    void RefreshFailed(const std::string& error)
+    {
+        ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: Failed to load the whitelist: {}", error));
+        StopRefresh();
+    }
+
+    // Starts reloading the whitelist on the master. The query runs on a
+    // non-blocking connection of its own which the timer polls, so neither
+    // connecting nor reading a large table holds up the main loop.
+    void StartRefresh()
+    {
+        last_sync = ServerInstance->Time();
+        if (refresh_state != RefreshState::IDLE)
+            return; // The last reload is still running.
+
+        if (refresh_db && PQstatus(refresh_db) != CONNECTION_OK)
+            StopRefresh();
+
+        if (refresh_db)
+        {
+            SendRefresh();
+            return;
+        }
+
+        refresh_db = PQconnectStart(conninfo.c_str());
+        if (!refresh_db || PQstatus(refresh_db) == CONNECTION_BAD || PQsetnonblocking(refresh_db, 1) == -1)
+        {
+            RefreshFailed(refresh_db ? PQerrorMessage(refresh_db) : "out of memory");
+            return;
+        }
+
+        refresh_state = RefreshState::CONNECTING;
+        refresh_write = true;
+    }
+
+    void SendRefresh()
+    {
+        if (!PQsendQuery(refresh_db, "SELECT ip_address FROM ircaccess_alloweduser"))
+        {
+            RefreshFailed(PQerrorMessage(refresh_db));
+            return;
+        }
+        refresh_state = RefreshState::QUERYING;
+    }
+
+    // Takes the reload as far as it can go without waiting on the database.
+    void PollRefresh()
+    {
+        if (refresh_state == RefreshState::CONNECTING)
+        {
+            // libpq must only be polled once the socket is ready.
+            pollfd pfd = { PQsocket(refresh_db), static_cast<short>(refresh_write ? POLLOUT : POLLIN), 0 };
+            if (poll(&pfd, 1, 0) <= 0)
+                return;
+
+            switch (PQconnectPoll(refresh_db))
+            {
+                case PGRES_POLLING_READING:
+                    refresh_write = false;
+                    break;
+
+                case PGRES_POLLING_WRITING:
+                    refresh_write = true;
+                    break;
+
+                case PGRES_POLLING_OK:
+                    SendRefresh();
+                    break;
+
+                case PGRES_POLLING_FAILED:
+                    RefreshFailed(PQerrorMessage(refresh_db));
+                    break;
+
+                default:
+                    break;
+            }
+            return;
+        }
+
+        if (refresh_state != RefreshState::QUERYING)
+            return;
+
+        if (PQflush(refresh_db) < 0 || !PQconsumeInput(refresh_db))
+        {
+            RefreshFailed(PQerrorMessage(refresh_db));
+            return;
+        }
+
+        if (PQisBusy(refresh_db))
+            return;
+
+        PGresult* res = PQgetResult(refresh_db);
+        while (PGresult* extra = PQgetResult(refresh_db))
+            PQclear(extra);
+        refresh_state = RefreshState::IDLE;
+
+        if (!res || PQresultStatus(res) != PGRES_TUPLES_OK)
+        {
+            ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: Failed to load the whitelist: {}", res ? PQresultErrorMessage(res) : PQerrorMessage(refresh_db)));
+            PQclear(res);
+            return;
+        }
+
+        CaptchaReplica::KeySet keys;
+        keys.reserve(PQntuples(res));
+        for (int row = 0; row < PQntuples(res); ++row)
+        {
+            irc::sockets::sockaddrs sa;
+            if (sa.from_ip(PQgetvalue(res, row, 0)))
+                keys.insert(CaptchaKey(sa));
+        }
+        PQclear(res);
+        ApplyRefresh(std::move(keys));
+    }
+
+    // Brings the master's copy of the whitelist up to date with a reload and
+    // publishes what changed, or a whole snapshot if that is smaller.
+    void ApplyRefresh(CaptchaReplica::KeySet keys)
+    {
+        if (!allowlist.IsLoaded())
+        {
+            allowlist.Replace(std::move(keys), ServerInstance->Time(), 0);
+            Republish();
+            ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: Loaded {} whitelisted IPs.", allowlist.Size()));
+            return;
+        }
+
+        std::vector<CaptchaKey> added;
+        std::vector<CaptchaKey> removed;
+        for (const auto& key : keys)
+        {
+            if (!allowlist.Contains(key))
+                added.push_back(key);
+        }
+        for (const auto& key : allowlist.Keys())
+        {
+            if (!keys.count(key))
+                removed.push_back(key);
+        }
+
+        for (const auto& key : removed)
+            ip_cache.Erase(key);
+
+        // A filter cannot forget addresses, so removed ones stay in it as
+        // false positives for the master to answer, and it gets less
+        // accurate as it fills up. It is only rebuilt and sent out again
+        // once either has gone too far; until then only additions go out.
+        bool rebuild = false;
+        if (bloom)
+        {
+            size_t entries = published_entries + added.size();
+            size_t stale = entries - std::min(entries, keys.size());
+            rebuild = stale > entries * BLOOM_MAX_STALE
+                || published.FalsePositiveRate(entries) > std::max(bloom_fprate, published_fprate) * BLOOM_MAX_DECAY;
+        }
+
+        if (rebuild || added.size() + removed.size() > MAX_DELTA)
+        {
+            allowlist.Replace(std::move(keys), allowlist.Epoch(), allowlist.Serial() + 1);
+            Republish();
+            return;
+        }
+
+        for (const auto& key : added)
+        {
+            allowlist.Add(key);
+            if (bloom)
+            {
+                published.Add(key);
+                published_entries++;
+            }
+        }
+        for (const auto& key : removed)
+            allowlist.Remove(key);
+        PublishChanges("ADD", added);
+        PublishChanges("DEL", removed);
+    }
+
+    // Sends every server a new snapshot, building a new filter first when
+    // publishing one.
+    void Republish()
+    {
+        if (bloom)
+        {
+            uint64_t bits;
+            unsigned int hashes;
+            size_t capacity = allowlist.Size() + allowlist.Size() / 4 + 64; // Room for additions until the next rebuild
+            CaptchaBloomFilter::Size(capacity, bloom_fprate, bloom_maxsize, bits, hashes);
+            published.Reset(bits, hashes);
+            for (const auto& key : allowlist.Keys())
+                published.Add(key);
+            published_entries = allowlist.Size();
+            published_fprate = published.FalsePositiveRate(published_entries);
+            ServerInstance->Logs.Debug(MODNAME, INSP_FORMAT("Built a {} byte filter with {} hashes for {} whitelisted IPs.", bits / 8, hashes, allowlist.Size()));
+        }
+        SendSnapshot("*");
+    }
+
+    void SendSync(const std::string& target, const CommandBase::Params& params)
+    {
+        ServerInstance->PI->SendEncapsulatedData(target, "RECAPTCHA-SYNC", params);
+    }
+
+    void SendSnapshot(const std::string& target)
+    {
+        std::vector<std::string> chunks;
+        if (!bloom)
+            CaptchaReplica::Pack(allowlist.Keys(), chunks);
+
+        std::string epoch = ConvToStr(allowlist.Epoch());
+        std::string serial = ConvToStr(allowlist.Serial());
+        if (bloom)
+        {
+            const std::string& data = published.Data();
+            SendSync(target, { "FILTER", epoch, serial, INSP_FORMAT("{}:{}", published.Bits(), published.Hashes()) });
+            for (size_t pos = 0; pos < data.size(); pos += CaptchaReplica::CHUNK_BYTES)
+                SendSync(target, { "DATA", epoch, serial, Base64::Encode(data.substr(pos, CaptchaReplica::CHUNK_BYTES)) });
+            SendSync(target, { "END", epoch, serial });
+            return;
+        }
+
+        SendSync(target, { "BEGIN", epoch, serial, ConvToStr(allowlist.Size()) });
+        for (const auto& chunk : chunks)
+            SendSync(target, { "DATA", epoch, serial, chunk });
+        SendSync(target, { "END", epoch, serial });
+    }
+
+    // Sends changes to every server, each chunk numbered as its own change.
+    template<typename Keys>
+    void PublishChanges(const std::string& action, const Keys& keys)
+    {
+        std::vector<std::string> chunks;
+        CaptchaReplica::Pack(keys, chunks);
+        for (const auto& chunk : chunks)
+            SendSync("*", { action, ConvToStr(allowlist.Epoch()), ConvToStr(allowlist.NextSerial()), chunk });
+    }
+
+    // Records an address added on the master and tells the other servers.
+    void PublishAdd(const std::string& ip)
+    {
+        irc::sockets::sockaddrs sa;
+        if (!allowlist.IsLoaded() || !sa.from_ip(ip))
+            return;
+
+        CaptchaKey key(sa);
+        if (!allowlist.Add(key))
+            return;
+
+        if (bloom)
+        {
+            published.Add(key);
+            published_entries++;
+        }
+        PublishChanges("ADD", std::vector<CaptchaKey>{ key });
+    }
+
+    void RequestSnapshot()
+    {
+        time_t now = ServerInstance->Time();
+        if (now - last_request < SNAPSHOT_RETRY)
+            return;
+
+        last_request = now;
+        SendSync(SyncMaster(), { "REQUEST" });
+    }
+
+    // Handles whitelist replication traffic from another server.
+    void HandleSync(User* server, const CommandBase::Params& parameters)
+    {
+        const std::string& action = parameters[0];
+        if (action == "REQUEST")
+        {
+            if (mode == "master" && allowlist.IsLoaded())
+                SendSnapshot(server->server->GetName());
+            return;
+        }
+
+        if (mode == "master" || server->server->GetName() != SyncMaster() || parameters.size() < 3)
+            return;
+
+        time_t epoch = ConvToNum<time_t>(parameters[1]);
+        uint64_t serial = ConvToNum<uint64_t>(parameters[2]);
+        std::vector<CaptchaKey> keys;
+        bool packed = action == "ADD" || action == "DEL" || (action == "DATA" && !allowlist.IsReceivingFilter());
+        if (packed && (parameters.size() < 4 || !CaptchaReplica::Unpack(parameters[3], keys)))
+            return;
+
+        if (action == "BEGIN")
+        {
+            allowlist.BeginSnapshot(epoch, serial);
+        }
+        else if (action == "FILTER" && parameters.size() > 3)
+        {
+            irc::sepstream stream(parameters[3], ':');
+            std::string bits;
+            std::string hashes;
+            if (stream.GetToken(bits) && stream.GetToken(hashes))
+                allowlist.BeginFilter(epoch, serial, ConvToNum<uint64_t>(bits), ConvToNum<unsigned int>(hashes));
+        }
+        else if (action == "DATA" && allowlist.IsReceivingFilter())
+        {
+            if (parameters.size() > 3)
+                allowlist.StageFilter(epoch, serial, Base64::Decode(parameters[3]));
+        }
+        else if (action == "DATA")
+        {
+            allowlist.Stage(epoch, serial, keys);
+        }
+        else if (action == "END")
+        {
+            if (!allowlist.EndSnapshot(epoch, serial))
+            {
+                ServerInstance->SNO.WriteToSnoMask('a', "reCAPTCHA: Received a malformed whitelist from the master server.");
+                return;
+            }
+
+            // A full list is authoritative, so verdicts cached from master
+            // replies are no longer needed. A filter only settles negatives,
+            // so the master's positive verdicts are kept unless the filter
+            // rules them out.
+            if (allowlist.IsFiltered())
+                ip_cache.EraseIf([this](const CaptchaKey& key) { return !allowlist.MayContain(key); });
+            else
+                ip_cache.Reset(cache_size);
+
+            // Users parked as definitely not allowed may now be let in, or
+            // need the master to decide a filter match.
+            std::vector<CaptchaKey> allowed;
+            for (auto& [key, check] : waiting)
+            {
+                if (allowlist.Contains(key))
+                {
+                    allowed.push_back(key);
+                }
+                else if (check.master.empty() && check.ip.empty() && allowlist.MayContain(key))
+                {
+                    check.ip = key.ToString();
+                    SendCheck(check);
+                }
+            }
+            for (const auto& key : allowed)
+                ReleaseWaiting(key, true);
+
+            if (allowlist.IsFiltered())
+                ServerInstance->SNO.WriteToSnoMask('a', "reCAPTCHA: Received a whitelist filter from the master server.");
+            else
+                ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: Received {} whitelisted IPs from the master server.", allowlist.Size()));
+        }
+        else if (action == "ADD" || action == "DEL")
+        {
+            if (!allowlist.Follows(epoch, serial))
+            {
+                RequestSnapshot();
+                return;
+            }
+
+            for (const auto& key : keys)
+            {
+                if (action == "ADD")
+                {
+                    allowlist.Add(key);
+                    ReleaseWaiting(key, true);
+                }
+                else
+                {
+                    allowlist.Remove(key);
+                    ip_cache.Erase(key);
+                }
+            }
+        }
+    }
+
+    // Answers a RECAPTCHA request forwarded by another server. Only the
+    // master has a database to answer from.
+    CmdResult HandleRemote(User* server, const CommandBase::Params& parameters)
+    {
+        // The command takes a single parameter for local opers' "status".
+        if (parameters.size() < 2)
+        {
+            ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: Ignoring malformed request from {}.", server->server->GetName()));
+            return CmdResult::FAILURE;
+        }
+
+        const std::string& action = parameters[0];
+        const std::string& ip = parameters[1];
+        if (mode != "master" || (action != "add" && action != "check"))
+            return CmdResult::FAILURE;
+
+        // A check the database could not answer is an "error" rather than a
+        // "failure", so the asking server does not take it as a verdict.
+        irc::sockets::sockaddrs sa;
+        bool success = false;
+        bool answered = true;
+        std::string error;
+        if (sa.from_ip(ip))
+        {
+            if (action == "add")
+            {
+                success = InsertAllowed(ip, error);
+                if (success)
+                    PublishAdd(ip);
+            }
+            else if (allowlist.IsLoaded() && allowlist.Contains(CaptchaKey(sa)))
+            {
+                success = true;
+            }
+            else if (!QueryAllowed(ip, success, error))
+            {
+                success = false;
+                answered = false;
+            }
+            else if (success)
+            {
+                // Verified since the last reload; tell everyone now.
+                PublishAdd(ip);
+            }
+        }
+
+        if (!error.empty())
+            ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: Failed to {} IP {} for {}: {}", action, ip, server->server->GetName(), error));
+
+        CommandBase::Params response_params;
+        response_params.push_back(action);
+        response_params.push_back(ip);
+        response_params.push_back(success ? "success" : (answered ? "failure" : "error"));
+        ServerInstance->PI->SendEncapsulatedData(server->server->GetName(), "RECAPTCHA-REPLY", response_params);
+        return CmdResult::SUCCESS;
+    }
+
+    static long long NowMs()
+    {
+        return static_cast<long long>(ServerInstance->Time()) * 1000 + ServerInstance->Time_ns() / 1000000;
+    }
+
+    CaptchaMaster* FindMaster(const std::string& name)
+    {
+        for (auto& master : masters)
+        {
+            if (master.name == name)
+                return &master;
+        }
+        return nullptr;
+    }
+
+    // Marks the masters which are linked to the network.
+    void UpdateReachability()
+    {
+        ProtocolInterface::ServerList servers;
+        ServerInstance->PI->GetServerList(servers);
+        for (auto& master : masters)
+        {
+            master.reachable = std::any_of(servers.begin(), servers.end(), [&master](const ProtocolInterface::ServerInfo& server)
+            {
+                return server.servername == master.name;
+            });
+        }
+    }
+
+    // Picks the linked master with the lowest reply time, trying unmeasured
+    // ones first in the configured order. Masters which recently timed out
+    // are only used when no other is linked.
+    CaptchaMaster* SelectMaster(const CaptchaMaster* exclude = nullptr)
+    {
+        time_t now = ServerInstance->Time();
+        CaptchaMaster* best = nullptr;
+        CaptchaMaster* fallback = nullptr;
+        for (auto& master : masters)
+        {
+            if (!master.reachable || &master == exclude)
+                continue;
+
+            if (master.suspended_until > now)
+            {
+                if (!fallback)
+                    fallback = &master;
+                continue;
+            }
+
+            if (!best || master.rtt < best->rtt)
+                best = &master;
+        }
+        return best ? best : fallback;
+    }
+
+    // The master whose whitelist is replicated: the first linked one.
+    const std::string& SyncMaster() const
+    {
+        for (const auto& master : masters)
+        {
+            if (master.reachable)
+                return master.name;
+        }
+        return masters.front().name;
+    }
+
+    // Asks the best master about a pending check, other than the one which
+    // just failed to answer unless it is the only one linked.
+    void SendCheck(CaptchaPendingCheck& check, const CaptchaMaster* exclude = nullptr)
+    {
+        CaptchaMaster* master = SelectMaster(exclude);
+        if (!master && exclude)
+            master = SelectMaster();
+        if (!master)
+        {
+            check.master.clear();
+            return;
+        }
+
+        CommandBase::Params params;
+        params.push_back("check");
+        params.push_back(check.ip);
+        ServerInstance->PI->SendEncapsulatedData(master->name, "RECAPTCHA", params);
+        check.master = master->name;
+        check.sent_ms = NowMs();
+        master->sent++;
+        ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: Sent verification request for IP {} to master server {}.", check.ip, master->name));
+    }
+
+    // Sends checks which went unanswered to another master, and checks made
+    // while no master was linked to one which now is. Users waiting for the
+    // whitelist to be published have no address to check.
+    void ExpireChecks()
+    {
+        long long now = NowMs();
+        for (auto& [key, check] : waiting)
+        {
+            if (check.master.empty())
+            {
+                if (!check.ip.empty())
+                    SendCheck(check);
+                continue;
+            }
+
+            if (now - check.sent_ms < check_timeout * 1000)
+                continue;
+
+            CaptchaMaster* master = FindMaster(check.master);
+            if (master)
+            {
+                master->timeouts++;
+                master->suspended_until = ServerInstance->Time() + MASTER_SUSPEND;
+            }
+            ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: Master server {} did not answer for IP {}.", check.master, check.ip));
+            SendCheck(check, master);
+        }
+    }
+
+    // Applies an answer from a master: the verdict is cached and users
+    // waiting on the address are let in, their held joins completing now.
+    // Only the answer to the check this server has in flight for the
+    // address settles it; answers to an oper's check are just reported. A
+    // check the master could not answer is not a verdict, so the users keep
+    // waiting and the timer asks again.
+    void ApplyReply(const std::string& source, const std::string& action, const std::string& ip, bool success, bool answered)
+    {
+        irc::sockets::sockaddrs sa;
+        CaptchaMaster* master = FindMaster(source);
+        if (!master || !sa.from_ip(ip))
+            return;
+
+        CaptchaKey key(sa);
+        auto it = waiting.find(key);
+        bool ours = action == "check" && it != waiting.end() && it->second.master == source;
+
+        // A master which cannot reach its database answers quickly but
+        // uselessly, so an error counts against it like a timeout.
+        if (!answered)
+        {
+            master->errors++;
+            ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: Master server {} could not {} IP {}.", source, action, ip));
+            if (!ours)
+                return;
+
+            master->suspended_until = ServerInstance->Time() + MASTER_SUSPEND;
+            if (SelectMaster(master))
+                SendCheck(it->second, master);
+            return;
+        }
+
+        master->answered++;
+        if (ours)
+        {
+            double sample = static_cast<double>(NowMs() - it->second.sent_ms);
+            master->rtt = master->rtt ? master->rtt + RTT_WEIGHT * (sample - master->rtt) : sample;
+            master->suspended_until = 0;
+        }
+
+        if (action == "add")
+        {
+            if (success)
+            {
+                ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: Successfully added IP {} via master server.", ip));
+                ip_cache.Insert(key, ServerInstance->Time() + cache_duration);
+                ReleaseWaiting(key, true);
+            }
+            else
+            {
+                ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: Failed to add IP {} via master server.", ip));
+            }
+        }
+        else if (action == "check")
+        {
+            if (success)
+                ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: IP {} is verified in the whitelist via master server {}.", ip, source));
+            else
+                ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: IP {} is NOT verified in the whitelist via master server {}.", ip, source));
+
+            if (!ours)
+                return;
+
+            if (success)
+                ip_cache.Insert(key, ServerInstance->Time() + cache_duration);
+            else
+                ip_cache.Erase(key);
+            ReleaseWaiting(key, success);
+        }
+    }
+
+    CaptchaPendingCheck& AddWaiting(const CaptchaKey& key, const std::string& uuid)
+    {
+        CaptchaPendingCheck& check = waiting[key];
+        if (std::find(check.uuids.begin(), check.uuids.end(), uuid) == check.uuids.end())
+            check.uuids.push_back(uuid);
+        return check;
+    }
+
+    void ReleaseWaiting(const CaptchaKey& key, bool allowed)
+    {
+        auto it = waiting.find(key);
+        if (it == waiting.end())
+            return;
+
+        std::vector<std::string> uuids;
+        uuids.swap(it->second.uuids);
+        waiting.erase(it);
+
+        for (const auto& uuid : uuids)
+        {
+            LocalUser* user = IS_LOCAL(ServerInstance->Users.FindUUID(uuid));
+            if (!user || user->quitting)
+                continue;
+
+            std::vector<CaptchaPendingJoin> joins;
+            std::vector<CaptchaPendingJoin>* pending = pending_joins.Get(user);
+            if (pending)
+                joins.swap(*pending);
+            pending_joins.Unset(user);
+
+            if (!allowed)
+            {
+                if (!joins.empty())
+                    user->WriteNotice("*** reCAPTCHA: Your address is not verified yet. Please verify at " + captcha_url + " and then join again.");
+                continue;
+            }
+
+            captcha_success.Set(user, "passed");
+            SyncMetadata(user);
+            for (const auto& join : joins)
+                Channel::JoinUser(user, join.channel, false, join.key);
+        }
+    }
+
+    void SendStatus(User* user)
+    {
+        if (allowlist.IsLoaded())
+            user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Whitelist {} at change {}, {} checks pending.", allowlist.IsFiltered() ? "filter" : ConvToStr(allowlist.Size()) + " IPs", allowlist.Serial(), waiting.size()));
+        else
+            user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Whitelist not loaded, {} checks pending.", waiting.size()));
+
+        time_t now = ServerInstance->Time();
+        for (const auto& master : masters)
+        {
+            double failures = master.sent ? 100.0 * (master.timeouts + master.errors) / master.sent : 0;
+            user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Master {}: {}{}, latency {:.1f} ms, {} sent, {} answered, {} errors, {} timed out ({:.1f}% failed)",
+                master.name, master.reachable ? "linked" : "not linked", master.suspended_until > now ? " (suspended)" : "",
+                master.rtt, master.sent, master.answered, master.errors, master.timeouts, failures));
+        }
+    }
+
+    // Holds a join until the master answers for the user's address.
+    void QueueJoin(LocalUser* user, const std::string& cname, const std::string& keygiven)
+    {
+        std::vector<CaptchaPendingJoin>* joins = pending_joins.Get(user);
+        if (!joins)
+            joins = pending_joins.SetFwd(user);
+
+        for (const auto& join : *joins)
+        {
+            if (irc::equals(join.channel, cname))
+                return;
+        }
+
+        if (joins->size() < MAX_PENDING_JOINS)
+            joins->push_back({ cname, keygiven });
+    }
+
     class CommandRecaptcha : public Command
     {
     private:
         ModuleCaptchaCheck* parent;
-​
+
     public:
         CommandRecaptcha(Module* Creator, ModuleCaptchaCheck* Parent)
-            : Command(Creator, "RECAPTCHA", 2, 2), parent(Parent)
+            : Command(Creator, "RECAPTCHA", 1, 2), parent(Parent)
         {
-            syntax = { "<add|check> <ip>" };
+            syntax = { "<add|check> <ip>", "status" };
         }
-​
+
         CmdResult Handle(User* user, const Params& parameters) override
         {
+            // Requests from other servers arrive through ENCAP.
+            if (IS_SERVER(user))
+                return parent->HandleRemote(user, parameters);
+
             if (!user->HasPrivPermission("users/auspex"))
             {
                 user->WriteNotice("*** reCAPTCHA: You do not have permission to use this command.");
                 return CmdResult::FAILURE;
             }
-​
+
             const std::string& action = parameters[0];
+            if (action == "status")
+            {
+                parent->SendStatus(user);
+                return CmdResult::SUCCESS;
+            }
+
+            if (parameters.size() < 2)
+            {
+                user->WriteNotice("*** reCAPTCHA: Unknown action. Use 'add <ip>', 'check <ip>' or 'status'.");
+                return CmdResult::FAILURE;
+            }
+
             const std::string& ip = parameters[1];
-​
             if (action == "add")
             {
                 if (parent->mode != "master")
                 {
+                    CaptchaMaster* master = parent->SelectMaster();
+                    if (!master)
+                    {
+                        user->WriteNotice("*** reCAPTCHA: No master server is linked.");
+                        return CmdResult::FAILURE;
+                    }
+
                     CommandBase::Params params;
                     params.push_back("add");
                     params.push_back(ip);
-​
-                    ServerInstance->PI->SendEncapsulatedData(parent->masterserver, "RECAPTCHA", params);
-                    user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Request to add IP {} sent to the master server.", ip));
+
+                    ServerInstance->PI->SendEncapsulatedData(master->name, "RECAPTCHA", params);
+                    user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Request to add IP {} sent to the master server {}.", ip, master->name));
                     return CmdResult::SUCCESS;
                 }
-​
-                PGconn* conn = parent->GetConnection();
-                if (!conn)
-                {
-                    user->WriteNotice("*** reCAPTCHA: Database connection unavailable.");
-                    return CmdResult::FAILURE;
-                }
-​
-                std::string query = INSP_FORMAT("INSERT INTO ircaccess_alloweduser (ip_address) VALUES ('{}')", ip);
-                PGresult* res = PQexec(conn, query.c_str());
-​
-                if (PQresultStatus(res) != PGRES_COMMAND_OK)
+
+                std::string error;
+                if (!parent->InsertAllowed(ip, error))
                 {
-                    user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Failed to add IP {}: {}", ip, PQerrorMessage(conn)));
-                    PQclear(res);
+                    user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Failed to add IP {}: {}", ip, error));
                     return CmdResult::FAILURE;
                 }
-​
-                PQclear(res);
+
+                parent->PublishAdd(ip);
                 user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Successfully added IP {} to the whitelist.", ip));
                 return CmdResult::SUCCESS;
             }
@@ -125,27 +1565,15 @@ private:
             {
                 if (parent->mode == "master")
                 {
-                    PGconn* conn = parent->GetConnection();
-                    if (!conn)
+                    bool allowed;
+                    std::string error;
+                    if (!parent->QueryAllowed(ip, allowed, error))
                     {
-                        user->WriteNotice("*** reCAPTCHA: Database connection unavailable.");
+                        user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Failed to check IP {}: {}", ip, error));
                         return CmdResult::FAILURE;
                     }
-​
-                    std::string query = INSP_FORMAT("SELECT COUNT(*) FROM ircaccess_alloweduser WHERE ip_address = '{}'", ip);
-                    PGresult* res = PQexec(conn, query.c_str());
-​
-                    if (PQresultStatus(res) != PGRES_TUPLES_OK)
-                    {
-                        user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Failed to check IP {}: {}", ip, PQerrorMessage(conn)));
-                        PQclear(res);
-                        return CmdResult::FAILURE;
-                    }
-​
-                    int count = atoi(PQgetvalue(res, 0, 0));
-                    PQclear(res);
-​
-                    if (count > 0)
+
+                    if (allowed)
                     {
                         user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: IP {} is verified in the whitelist.", ip));
                         return CmdResult::SUCCESS;
@@ -158,39 +1586,155 @@ private:
                 }
                 else
                 {
+                    CaptchaMaster* master = parent->SelectMaster();
+                    if (!master)
+                    {
+                        user->WriteNotice("*** reCAPTCHA: No master server is linked.");
+                        return CmdResult::FAILURE;
+                    }
+
                     CommandBase::Params params;
                     params.push_back("check");
                     params.push_back(ip);
-                    ServerInstance->PI->SendEncapsulatedData(parent->masterserver, "RECAPTCHA", params);
-                    user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Request sent to master server for IP {}.", ip));
+                    ServerInstance->PI->SendEncapsulatedData(master->name, "RECAPTCHA", params);
+                    user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Request sent to master server {} for IP {}.", master->name, ip));
                     return CmdResult::SUCCESS;
                 }
             }
-​
-            user->WriteNotice("*** reCAPTCHA: Unknown action. Use 'add <ip>' or 'check <ip>'.");
+
+            user->WriteNotice("*** reCAPTCHA: Unknown action. Use 'add <ip>', 'check <ip>' or 'status'.");
             return CmdResult::FAILURE;
         }
     };
-​
+
+    // The master's answer to a forwarded RECAPTCHA request.
+    class CommandRecaptchaReply : public Command
+    {
+    private:
+        ModuleCaptchaCheck* parent;
+
+    public:
+        CommandRecaptchaReply(Module* Creator, ModuleCaptchaCheck* Parent)
+            : Command(Creator, "RECAPTCHA-REPLY", 3, 3), parent(Parent)
+        {
+            access_needed = CmdAccess::SERVER;
+        }
+
+        CmdResult Handle(User* user, const Params& parameters) override
+        {
+            parent->ApplyReply(user->server->GetName(), parameters[0], parameters[1], parameters[2] == "success", parameters[2] != "error");
+            return CmdResult::SUCCESS;
+        }
+    };
+
+    // Whitelist snapshots and changes published by the master, and requests
+    // for a snapshot from the other servers.
+    class CommandRecaptchaSync : public Command
+    {
+    private:
+        ModuleCaptchaCheck* parent;
+
+    public:
+        CommandRecaptchaSync(Module* Creator, ModuleCaptchaCheck* Parent)
+            : Command(Creator, "RECAPTCHA-SYNC", 1, 4), parent(Parent)
+        {
+            access_needed = CmdAccess::SERVER;
+        }
+
+        CmdResult Handle(User* user, const Params& parameters) override
+        {
+            parent->HandleSync(user, parameters);
+            return CmdResult::SUCCESS;
+        }
+    };
+
     CommandRecaptcha cmd;
-​
+    CommandRecaptchaReply replycmd;
+    CommandRecaptchaSync synccmd;
+
 public:
     ModuleCaptchaCheck()
         : Module(VF_VENDOR, "Requires users to solve a Google reCAPTCHA before joining channels."),
+          ServerProtocol::LinkEventListener(this),
           db(nullptr),
+          timer([this]()
+          {
+              time_t now = ServerInstance->Time();
+              ip_cache.Expire(now);
+              if (mode == "master")
+              {
+                  PollRefresh();
+                  if (now - last_sync >= sync_interval)
+                      StartRefresh();
+              }
+              else
+              {
+                  UpdateReachability();
+                  ExpireChecks();
+                  if (!allowlist.IsLoaded())
+                      RequestSnapshot();
+              }
+          }),
           captcha_success(this, "captcha-success", ExtensionType::USER, true),
+          pending_joins(this, "captcha-pending-joins", ExtensionType::USER),
           account_api(this),
-          cmd(this, this) // Command is constructed here
+          cmd(this, this), // Command is constructed here
+          replycmd(this, this),
+          synccmd(this, this)
     {}
-​
+
+    ~ModuleCaptchaCheck() override
+    {
+        StopRefresh();
+    }
+
+    void init() override
+    {
+        ServerInstance->Timers.AddTimer(&timer);
+    }
+
     void ReadConfig(ConfigStatus& status) override
     {
         auto& tag = ServerInstance->Config->ConfValue("captchaconfig");
         mode = tag->getString("mode");
         conninfo = tag->getString("conninfo", "", mode == "master");
         captcha_url = tag->getString("url");
-        masterserver = tag->getString("masterserver");
-​
+        check_timeout = tag->getDuration("checktimeout", 5, 1, 60);
+
+        // Slaves may ask any of several masters, each with its own database.
+        std::vector<CaptchaMaster> newmasters;
+        irc::commasepstream masterstream(tag->getString("masterserver"));
+        std::string mastername;
+        while (masterstream.GetToken(mastername))
+        {
+            CaptchaMaster* existing = FindMaster(mastername);
+            newmasters.push_back(existing ? *existing : CaptchaMaster());
+            newmasters.back().name = mastername;
+        }
+        if (mode != "master" && newmasters.empty())
+            throw ModuleException(this, "<captchaconfig:masterserver> is a required configuration option on slave servers.");
+        masters.swap(newmasters);
+        UpdateReachability();
+        cache_duration = tag->getDuration("cacheduration", 600, 1);
+        sync_interval = tag->getDuration("syncinterval", 60, 5);
+
+        // The master may publish a Bloom filter instead of the whole
+        // whitelist, which slaves can only use to rule addresses out.
+        bool newbloom = irc::equals(tag->getString("replication", "full"), "bloom");
+        double fprate = tag->getFloat("bloomfprate", 0.01, 0.0001, 0.5);
+        size_t maxsize = tag->getNum<size_t>("bloommaxsize", 1048576, 1024);
+        bool republish = newbloom != bloom || (newbloom && (fprate != bloom_fprate || maxsize != bloom_maxsize));
+        bloom = newbloom;
+        bloom_fprate = fprate;
+        bloom_maxsize = maxsize;
+
+        size_t cachesize = tag->getNum<size_t>("cachesize", 65536, 0);
+        if (cachesize != cache_size)
+        {
+            cache_size = cachesize;
+            ip_cache.Reset(cache_size);
+        }
+
         std::string whitelist = tag->getString("whitelistchan");
         irc::commasepstream whiteliststream(whitelist);
         std::string channel;
@@ -198,7 +1742,7 @@ public:
         {
             whitelist_channels.insert(channel);
         }
-​
+
         std::string whitelistport = tag->getString("whitelistport");
         irc::commasepstream portstream(whitelistport);
         std::string port;
@@ -213,20 +1757,49 @@ public:
                 ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("Invalid port in whitelistport: {}", port));
             }
         }
-​
+
+        // The reload connection is made again in case conninfo changed.
+        StopRefresh();
         if (mode == "master")
         {
             db = GetConnection();
+            if (!allowlist.IsLoaded())
+            {
+                StartRefresh();
+            }
+            else if (republish)
+            {
+                allowlist.NextSerial();
+                Republish();
+            }
         }
-​
+        else if (!allowlist.IsLoaded())
+        {
+            RequestSnapshot();
+        }
+
         ServerInstance->SNO.WriteToSnoMask('a', "Captcha module configuration loaded.");
     }
-​
+
+    void OnServerLink(const Server* server) override
+    {
+        if (mode == "master" && allowlist.IsLoaded())
+            SendSnapshot(server->GetName());
+        else if (mode != "master")
+            UpdateReachability();
+    }
+
+    void OnServerSplit(const Server* server, bool error) override
+    {
+        if (mode != "master")
+            UpdateReachability();
+    }
+
     void OnUserConnect(LocalUser* user) override
     {
         SyncMetadata(user);
     }
-​
+
     void OnDecodeMetadata(Extensible* target, const std::string& key, const std::string& value) override
     {
         if (key == "captcha-success")
@@ -239,173 +1812,112 @@ public:
             }
         }
     }
-​
+
     ModResult OnUserPreJoin(LocalUser* user, Channel* chan, const std::string& cname, std::string& privs, const std::string& keygiven, bool override) override
     {
         if (whitelist_channels.count(cname))
         {
             return MOD_RES_PASSTHRU;
         }
-​
+
         const std::string* status = captcha_success.Get(user);
         if (status && *status == "passed")
         {
             return MOD_RES_PASSTHRU;
         }
-​
+
         int port = user->server_sa.port();
         if (whitelist_ports.count(port))
         {
             return MOD_RES_PASSTHRU;
         }
-​
+
         std::string ip = user->client_sa.addr();
         if (!CheckCaptcha(ip, user))
         {
+            // Slaves retry the join themselves once the master answers.
+            if (mode != "master")
+                QueueJoin(user, cname, keygiven);
             user->WriteNotice("*** reCAPTCHA: Please verify at " + captcha_url + " before joining channels.");
             return MOD_RES_DENY;
         }
-​
+
         captcha_success.Set(user, "passed");
         SyncMetadata(user);
         return MOD_RES_PASSTHRU;
     }
-​
+
     bool CheckCaptcha(const std::string& ip, User* user)
     {
-        auto now = std::chrono::steady_clock::now();
-​
+        time_t now = ServerInstance->Time();
+        CaptchaKey key(user->client_sa);
+
+        // The replicated whitelist answers without asking the master. Slave
+        // users who are not on it wait for it to be published. A filter
+        // match may be a false positive, so the master decides those. The
+        // master's own copy may be up to syncinterval old, so it asks the
+        // database about anyone not on it.
+        if (allowlist.IsLoaded())
+        {
+            if (allowlist.Contains(key))
+                return true;
+
+            if (mode != "master" && !allowlist.MayContain(key))
+            {
+                AddWaiting(key, user->uuid);
+                return false;
+            }
+        }
+
         // Check local cache first.
-        if (ip_cache.find(ip) != ip_cache.end() && now < ip_cache[ip])
+        if (ip_cache.Find(key, now))
         {
             ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: Cached verification for IP {}.", ip));
             return true;
         }
-​
+
         if (mode != "master")
         {
-            CommandBase::Params params;
-            params.push_back("check");
-            params.push_back(ip);
-            ServerInstance->PI->SendEncapsulatedData(masterserver, "RECAPTCHA", params);
-​
-            // Mark the IP temporarily while waiting for master response.
-            ip_cache[ip] = now + std::chrono::seconds(30); // Cache for 30 seconds to prevent spamming.
-            ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: Sent verification request for IP {} to master server.", ip));
-            return false;
-        }
-​
-        PGconn* conn = GetConnection();
-        if (!conn)
-        {
-            ServerInstance->SNO.WriteToSnoMask('a', "reCAPTCHA: Database connection unavailable.");
+            // Only one check per address is in flight at a time. If the
+            // master does not answer in time the timer asks another.
+            CaptchaPendingCheck& check = AddWaiting(key, user->uuid);
+            if (check.master.empty())
+            {
+                check.ip = ip;
+                SendCheck(check);
+            }
             return false;
         }
-​
-        std::string query = INSP_FORMAT("SELECT COUNT(*) FROM ircaccess_alloweduser WHERE ip_address = '{}'", ip);
-        PGresult* res = PQexec(conn, query.c_str());
-​
-        if (PQresultStatus(res) != PGRES_TUPLES_OK)
+
+        bool allowed;
+        std::string error;
+        if (!QueryAllowed(ip, allowed, error))
         {
-            ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: Database query error: {}", PQerrorMessage(conn)));
-            PQclear(res);
+            ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: Database query error: {}", error));
             return false;
         }
-​
-        int count = atoi(PQgetvalue(res, 0, 0));
-        PQclear(res);
-​
-        if (count > 0)
+
+        if (allowed)
         {
-            ip_cache[ip] = now + std::chrono::minutes(CACHE_DURATION_MINUTES);
+            ip_cache.Insert(key, now + cache_duration);
+            PublishAdd(ip);
             return true;
         }
-​
+
         return false;
     }
-​
-    void OnEncapsulatedData(const std::string& source, const std::string& command, CommandBase::Params& parameters)
-{
-    if (command == "RECAPTCHA")
+
+    void OnUserDisconnect(LocalUser* user) override
     {
-        const std::string& action = parameters[0];
-        const std::string& ip = parameters[1];
-​
-        if (action == "add")
-        {
-            PGconn* conn = GetConnection();
-            CommandBase::Params response_params;
-            if (!conn)
-            {
-                response_params.push_back("add");
-                response_params.push_back(ip);
-                response_params.push_back("failure");
-                ServerInstance->PI->SendEncapsulatedData(source, "RECAPTCHA-REPLY", response_params);
-                return;
-            }
-​
-            std::string query = INSP_FORMAT("INSERT INTO ircaccess_alloweduser (ip_address) VALUES ('{}')", ip);
-            PGresult* res = PQexec(conn, query.c_str());
-​
-            response_params.push_back("add");
-            response_params.push_back(ip);
-            response_params.push_back((PQresultStatus(res) == PGRES_COMMAND_OK) ? "success" : "failure");
-            ServerInstance->PI->SendEncapsulatedData(source, "RECAPTCHA-REPLY", response_params);
-​
-            PQclear(res);
-        }
-        else if (action == "check")
-        {
-            PGconn* conn = GetConnection();
-            CommandBase::Params response_params;
-            if (!conn)
-            {
-                response_params.push_back("check");
-                response_params.push_back(ip);
-                response_params.push_back("failure");
-                ServerInstance->PI->SendEncapsulatedData(source, "RECAPTCHA-REPLY", response_params);
-                return;
-            }
-​
-            std::string query = INSP_FORMAT("SELECT COUNT(*) FROM ircaccess_alloweduser WHERE ip_address = '{}'", ip);
-            PGresult* res = PQexec(conn, query.c_str());
-​
-            response_params.push_back("check");
-            response_params.push_back(ip);
-            response_params.push_back((PQresultStatus(res) == PGRES_TUPLES_OK && atoi(PQgetvalue(res, 0, 0)) > 0) ? "success" : "failure");
-            ServerInstance->PI->SendEncapsulatedData(source, "RECAPTCHA-REPLY", response_params);
-​
-            PQclear(res);
-        }
-    }
-    else if (command == "RECAPTCHA-REPLY")
-    {
-        const std::string& action = parameters[0];
-        const std::string& ip = parameters[1];
-        const std::string& result = parameters[2];
-​
-        if (action == "add" && result == "success")
-        {
-            ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: Successfully added IP {} via master server.", ip));
-        }
-        else if (action == "add")
-        {
-            ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: Failed to add IP {} via master server.", ip));
-        }
-        else if (action == "check")
-        {
-            if (result == "success")
-            {
-                ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: IP {} is verified in the whitelist via master server.", ip));
-            }
-            else
-            {
-                ServerInstance->SNO.WriteToSnoMask('a', INSP_FORMAT("reCAPTCHA: IP {} is NOT verified in the whitelist via master server.", ip));
-            }
-        }
+        auto it = waiting.find(CaptchaKey(user->client_sa));
+        if (it == waiting.end())
+            return;
+
+        std::vector<std::string>& uuids = it->second.uuids;
+        uuids.erase(std::remove(uuids.begin(), uuids.end(), user->uuid), uuids.end());
+        if (uuids.empty())
+            waiting.erase(it);
     }
-}
-​
 };
-​
+
 MODULE_INIT(ModuleCaptchaCheck)